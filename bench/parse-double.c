@@ -0,0 +1,99 @@
+/* Microbenchmark of the double parser in src/parse.c against atof() and
+ * strtod(), on the kind of values the server sends for DOUBLE and DECIMAL
+ * columns.
+ *
+ * Not part of the package build. From the package root:
+ *
+ *   cc -O2 -std=gnu99 -Isrc bench/parse-double.c src/parse.c src/pow5.c \
+ *     -o parse-double && ./parse-double
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parse.h"
+
+#define N 2000000
+#define REPS 10
+
+typedef struct {
+  char **values;
+  size_t *lens;
+} Values;
+
+static unsigned long seed = 42;
+static unsigned long lcg(void) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return seed >> 33;
+}
+
+/* DECIMAL amounts, full precision doubles as MySQL prints them, and a few
+ * values with more digits than the fast path takes.
+ */
+static int sample(char* buffer, size_t size) {
+  unsigned long r = lcg() % 100;
+  if (r < 50)
+    return snprintf(buffer, size, "%lu.%02lu", lcg() % 100000, lcg() % 100);
+  if (r < 95)
+    return snprintf(buffer, size, "%.17g", (double) lcg() / (lcg() + 1));
+  return snprintf(buffer, size, "%lu%lu.%lu", lcg(), lcg(), lcg());
+}
+
+static Values make_values(void) {
+  Values v;
+  v.values = malloc(N * sizeof(char *));
+  v.lens = malloc(N * sizeof(size_t));
+  for (int i = 0; i < N; i++) {
+    char buffer[64];
+    int len = sample(buffer, sizeof(buffer));
+    v.values[i] = malloc(len + 1);
+    memcpy(v.values[i], buffer, len + 1);
+    v.lens[i] = len;
+  }
+  return v;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+  Values v = make_values();
+  double checks[3] = {0, 0, 0};
+  double times[3] = {0, 0, 0};
+
+  for (int i = 0; i < N; i++) {
+    double a = rmysql_atof(v.values[i], v.lens[i]), b = strtod(v.values[i], NULL);
+    if (memcmp(&a, &b, sizeof(double))) {
+      fprintf(stderr, "mismatch on %s\n", v.values[i]);
+      return 1;
+    }
+  }
+
+  for (int rep = 0; rep < REPS; rep++) {
+    double start = now();
+    for (int i = 0; i < N; i++)
+      checks[0] += atof(v.values[i]);
+    times[0] += now() - start;
+
+    start = now();
+    for (int i = 0; i < N; i++)
+      checks[1] += strtod(v.values[i], NULL);
+    times[1] += now() - start;
+
+    start = now();
+    for (int i = 0; i < N; i++)
+      checks[2] += rmysql_atof(v.values[i], v.lens[i]);
+    times[2] += now() - start;
+  }
+
+  const char* names[3] = {"atof", "strtod", "rmysql_atof"};
+  for (int k = 0; k < 3; k++) {
+    printf("%-12s %6.2f ns/value  (checksum %g)\n", names[k],
+      times[k] * 1e9 / ((double) N * REPS), checks[k]);
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+/* Microbenchmark of the integer parser in src/parse.h against atol() and
+ * strtol(), on the kind of values the server sends for INT columns.
+ *
+ * Not part of the package build. From the package root:
+ *
+ *   cc -O2 -std=gnu99 -Isrc bench/parse-int.c -o parse-int && ./parse-int
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parse.h"
+
+#define N 4000000
+#define REPS 10
+
+typedef struct {
+  char **values;
+  size_t *lens;
+} Values;
+
+static unsigned long seed = 42;
+static unsigned long lcg(void) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return seed >> 33;
+}
+
+/* Mostly small keys and counts, some large ids, a few negative values and
+ * the odd value that doesn't fit and has to go the slow way.
+ */
+static long sample(void) {
+  unsigned long r = lcg() % 100;
+  if (r < 40) return lcg() % 1000;
+  if (r < 70) return lcg() % 1000000;
+  if (r < 90) return lcg() % 2147483647;
+  if (r < 99) return -(long) (lcg() % 100000);
+  return 4000000000L + (long) (lcg() % 1000);
+}
+
+static Values make_values(void) {
+  Values v;
+  v.values = malloc(N * sizeof(char *));
+  v.lens = malloc(N * sizeof(size_t));
+  for (int i = 0; i < N; i++) {
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "%ld", sample());
+    v.values[i] = malloc(len + 1);
+    memcpy(v.values[i], buffer, len + 1);
+    v.lens[i] = len;
+  }
+  return v;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+  Values v = make_values();
+  long checks[3] = {0, 0, 0};
+  double times[3] = {0, 0, 0};
+
+  for (int i = 0; i < N; i++) {
+    if (rmysql_atoi(v.values[i], v.lens[i]) != (int) atol(v.values[i])) {
+      fprintf(stderr, "mismatch on %s\n", v.values[i]);
+      return 1;
+    }
+  }
+
+  for (int rep = 0; rep < REPS; rep++) {
+    double start = now();
+    for (int i = 0; i < N; i++)
+      checks[0] += (int) atol(v.values[i]);
+    times[0] += now() - start;
+
+    start = now();
+    for (int i = 0; i < N; i++)
+      checks[1] += (int) strtol(v.values[i], NULL, 10);
+    times[1] += now() - start;
+
+    start = now();
+    for (int i = 0; i < N; i++)
+      checks[2] += rmysql_atoi(v.values[i], v.lens[i]);
+    times[2] += now() - start;
+  }
+
+  const char* names[3] = {"atol", "strtol", "rmysql_atoi"};
+  for (int k = 0; k < 3; k++) {
+    printf("%-12s %6.2f ns/value  (checksum %ld)\n", names[k],
+      times[k] * 1e9 / ((double) N * REPS), checks[k]);
+  }
+  return 0;
+}
@@ -31,6 +31,16 @@ extern  "C" {
 #include <mysql_version.h>
 #include <mysql_com.h>
 #include <string.h>
+#include <pthread.h>
+
+// Threads =====================================================================
+// Connections are driven from the R thread, the only one that may call into
+// R. Statements and row decoding can be handed to other threads (see
+// RS_MySQL_runThread and RMySQLColumns), but the R thread waits for them to
+// finish, even when interrupted, before going on, so a connection's MYSQL
+// handle is only ever used by one thread at a time and needs no lock. The
+// driver's connection table is guarded by the driver lock; result set
+// tables are only ever touched from the R thread.
 
 // Objects =====================================================================
 
@@ -44,8 +54,22 @@ typedef struct RMySQLFields {
   int  *nullOk;         // DBMS indicator for DBMS'  NULL type
   int  *isVarLength;    // DBMS variable-length char type
   SEXPTYPE *Sclass;     // R/S class (type) -- may be overriden
+  cetype_t *encoding;   // of the strings in each column
 } RMySQLFields;
 
+// Output buffers for rows read over the binary protocol. Each column is
+// bound to a buffer of its R storage type, so that the client library
+// does the numeric conversions for us.
+typedef struct RMySQLBinds {
+  int num_fields;
+  MYSQL_BIND *bind;
+  unsigned long *length;  // actual length of the current value
+  my_bool *is_null;
+  my_bool *error;         // set when a value was truncated
+  void **buffer;
+  unsigned long *capacity; // allocated size of each buffer
+} RMySQLBinds;
+
 typedef struct st_sdbi_resultset {
   void  *drvResultSet;   // the actual (driver's) cursor/result set
   int  managerId;        // the 3 *Id's are used for
@@ -57,8 +81,31 @@ typedef struct st_sdbi_resultset {
   int  rowCount;         // rows fetched so far (SELECT-types)
   int  completed;        // have we fetched all rows?
   RMySQLFields* fields;
+  void  *drvStatement;   // prepared statement read through a server-side cursor
+  void  *drvBinds;       // output buffers bound to drvStatement
 } RS_DBI_resultSet;
 
+// A statement prepared on the server, kept with what's needed to run it
+typedef struct RMySQLStatement {
+  char *sql;                // normalised text, the cache key
+  MYSQL_STMT *stmt;
+  RMySQLFields *fields;     // NULL for statements that return no rows
+  RMySQLBinds *binds;       // bound to stmt's result
+  unsigned long last_used;
+  int cached;
+} RMySQLStatement;
+
+// Least recently used prepared statements of a connection
+typedef struct RMySQLStmtCache {
+  int capacity;
+  int size;
+  unsigned long clock;      // ticks on every use
+  double hits;
+  double misses;
+  int stale;                // a USE or schema change ran since they were prepared
+  RMySQLStatement **entries;
+} RMySQLStmtCache;
+
 typedef struct st_sdbi_connection {
   void  *conParams;                 // pointer to connection params (host, user, etc)
   void  *drvConnection;             // pointer to the actual DBMS connection struct
@@ -69,8 +116,25 @@ typedef struct st_sdbi_connection {
   int   counter;                    // total number of queries
   int   managerId;
   int   connectionId;
+  int   pid;                        // process that opened drvConnection
+  RMySQLStmtCache *statements;      // prepared on drvConnection
 } RS_DBI_connection;
 
+// Columns of a data frame being filled from a stored result. Numbers are
+// decoded straight into the output vectors; strings are kept as pointers
+// into the result until the R thread turns them into CHARSXPs.
+typedef struct RMySQLColumns {
+  int num_fields;
+  int num_rows;             // rows decoded so far
+  int capacity;             // rows allocated in the output
+  SEXPTYPE *Sclass;
+  int **ints;               // data of INTSXP columns
+  double **reals;           // data of REALSXP columns
+  const char ***chars;      // strings of the other columns (NULL for NA)
+  unsigned long **lengths;
+  cetype_t *encoding;
+} RMySQLColumns;
+
 typedef struct st_sdbi_conParams {
   char *dbname;
   char *username;
@@ -81,6 +145,17 @@ typedef struct st_sdbi_conParams {
   unsigned int  client_flag;
   char *groups;
   char *default_file;
+  int  interruptible;      // run statements so that Ctrl-C can stop them
+  unsigned int  connect_timeout;  // seconds, 0 for the client default
+  unsigned int  read_timeout;
+  unsigned int  write_timeout;
+  int  reconnect;          // reconnect when the server goes away
+  int  threads;            // threads decoding stored results
+  int  statement_cache;    // prepared statements kept per connection
+  char *charset;           // requested with mysql_set_character_set()
+  int  utf8;               // the negotiated character set is UTF-8
+  char **session;          // SET and USE statements to replay on reconnect
+  int  num_session;
 } RS_MySQL_conParams;
 
 
@@ -101,13 +176,27 @@ typedef struct MySQLDriver {
 #define CON_ID(handle) INTEGER(handle)[1]
 #define RES_ID(handle) INTEGER(handle)[2]
 
+// Fetch loops check for user interrupts every RMYSQL_CHECK_ROWS rows, and
+// report an interrupt by setting completed to RMYSQL_INTERRUPTED
+#define RMYSQL_CHECK_ROWS 1000
+#define RMYSQL_INTERRUPTED -2
+
+// How often an R thread waiting on workers checks for interrupts, in ms
+#define RMYSQL_POLL_MS 100
+// Longest wait between attempts to kill an interrupted statement, in ms
+#define RMYSQL_KILL_MAX_WAIT_MS 3200
+
 // Driver ----------------------------------------------------------------------
 
 MySQLDriver* rmysql_driver();
+void rmysql_driver_lock(void);
+void rmysql_driver_unlock(void);
 SEXP rmysql_driver_init(SEXP max_con_, SEXP fetch_default_rec_);
 SEXP rmysql_driver_info();
 
 SEXP rmysql_exception_info(SEXP conHandle);
+int rmysql_is_timeout(unsigned int errnum);
+void rmysql_error(unsigned int errnum, const char* context, const char* msg);
 
 // Connection ------------------------------------------------------------------
 
@@ -116,8 +205,16 @@ void RS_DBI_freeConnection(SEXP conHandle);
 RS_DBI_connection *RS_DBI_getConnection(SEXP handle);
 SEXP RS_DBI_asConHandle(int mgrId, int conId);
 SEXP RS_DBI_connectionInfo(SEXP con_Handle);
-SEXP RS_MySQL_newConnection(SEXP mgrHandle, SEXP s_dbname, SEXP s_username, SEXP s_password, SEXP s_myhost, SEXP s_unix_socket, SEXP s_port, SEXP s_client_flag, SEXP s_groups, SEXP s_default_file);
+SEXP RS_MySQL_newConnection(SEXP mgrHandle, SEXP s_dbname, SEXP s_username, SEXP s_password, SEXP s_myhost, SEXP s_unix_socket, SEXP s_port, SEXP s_client_flag, SEXP s_groups, SEXP s_default_file, SEXP s_interruptible, SEXP s_timeouts, SEXP s_reconnect, SEXP s_threads, SEXP s_charset, SEXP s_statement_cache);
 SEXP RS_MySQL_createConnection(SEXP mgrHandle, RS_MySQL_conParams *conParams);
+int RS_MySQL_connect(MYSQL* my_connection, RS_MySQL_conParams *conParams);
+cetype_t RS_MySQL_encoding(RS_MySQL_conParams *conParams);
+const char* RS_MySQL_text(RS_MySQL_conParams *conParams, SEXP x);
+int RS_MySQL_killQuery(RS_DBI_connection* con);
+int RS_MySQL_killThread(RS_MySQL_conParams* conParams, unsigned long thread_id);
+int RS_MySQL_reconnect(RS_DBI_connection* con);
+void RS_MySQL_recordSession(RS_MySQL_conParams *conParams, const char* statement);
+int RS_MySQL_replaySession(MYSQL* my_connection, RS_MySQL_conParams *conParams);
 SEXP RS_MySQL_cloneConnection(SEXP conHandle);
 SEXP RS_MySQL_closeConnection(SEXP conHandle);
 SEXP RS_MySQL_connectionInfo(SEXP conHandle);
@@ -133,25 +230,81 @@ RS_DBI_resultSet* RS_DBI_getResultSet(SEXP rsHandle);
 SEXP RS_DBI_asResHandle(int pid, int conId, int resId);
 SEXP RS_DBI_resultSetInfo(SEXP rsHandle);
 SEXP RS_MySQL_exec(SEXP conHandle, SEXP statement);
+int RS_MySQL_runThread(RS_DBI_connection* con, void (*work)(void*), void* data);
+int RS_MySQL_runThreadOn(RS_DBI_connection* con, MYSQL* my_connection,
+                         void (*work)(void*), void* data);
+void rmysql_deadline(struct timespec* ts, int ms);
+int RS_MySQL_query(RS_DBI_connection* con, const char* statement, int buffered, MYSQL_RES** my_result);
+int RS_MySQL_nextResult(RS_DBI_connection* con, MYSQL_RES** my_result);
+void RS_MySQL_revive(RS_DBI_connection* con);
+SEXP rmysql_connection_revive(SEXP conHandle);
+SEXP RS_MySQL_timeoutStatement(SEXP conHandle, SEXP statement, SEXP s_timeout);
 SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec);
+int RS_MySQL_fetchRows(MYSQL* my_connection, MYSQL_RES* my_result, RMySQLFields* flds, SEXP output, int* num_rec, int expand, int* completed);
+SEXP RS_MySQL_readDataFrame(MYSQL_RES* my_result, RS_MySQL_conParams* conParams, int* completed);
+SEXP RS_MySQL_getQuery(SEXP conHandle, SEXP statement);
+SEXP RS_MySQL_execMulti(SEXP conHandle, SEXP statements);
+SEXP RS_MySQL_readPartitions(SEXP conHandle, SEXP statements, SEXP lock);
 SEXP RS_MySQL_closeResultSet(SEXP rsHandle);
 SEXP RS_MySQL_nextResultSet(SEXP conHandle);
 SEXP RS_MySQL_moreResultSets(SEXP conHandle);
 SEXP RS_MySQL_resultSetInfo(SEXP rsHandle);
+RS_DBI_resultSet* RS_MySQL_pendingResult(RS_DBI_connection* con);
+void RS_MySQL_closePending(SEXP conHandle);
+
+// Transactions ----------------------------------------------------------------
+SEXP RS_MySQL_begin(SEXP conHandle);
+SEXP RS_MySQL_commit(SEXP conHandle);
+SEXP RS_MySQL_rollback(SEXP conHandle);
+SEXP RS_MySQL_execTransaction(SEXP conHandle, SEXP statements);
+
+// Prepared statements ---------------------------------------------------------
+SEXP RS_MySQL_execCursor(SEXP conHandle, SEXP statement, SEXP s_prefetch);
+int RS_MySQL_fetchCursor(RS_DBI_resultSet* result, SEXP output, int* num_rec, int expand, int* completed);
+void RS_MySQL_closeCursor(RS_DBI_resultSet* result);
+SEXP RS_MySQL_execPrepared(SEXP conHandle, SEXP statement, SEXP bind_data);
+RMySQLBinds* rmysql_binds_alloc(RMySQLFields* flds);
+void rmysql_binds_free(RMySQLBinds* binds);
+
+// Statement cache -------------------------------------------------------------
+RMySQLStmtCache* rmysql_stmt_cache_alloc(int capacity);
+void rmysql_stmt_cache_clear(RMySQLStmtCache* cache, int close);
+void rmysql_stmt_cache_free(RMySQLStmtCache* cache, int close);
+void rmysql_statement_free(RMySQLStatement* statement, int close);
+void rmysql_stmt_cache_check(RS_DBI_connection* con, const char* statement);
+RMySQLStatement* RS_MySQL_prepare(RS_DBI_connection* con, const char* sql);
+void RS_MySQL_releaseStatement(RS_DBI_connection* con, RMySQLStatement* statement, int failed);
 
 // Fields ----------------------------------------------------------------------
 void rmysql_fields_free(RMySQLFields* flds);
 void RS_DBI_allocOutput(SEXP output, RMySQLFields* flds, int num_rec, int expand);
 void make_data_frame(SEXP data);
 SEXP RS_DBI_copyFields(RMySQLFields* flds);
-RMySQLFields* RS_MySQL_createDataMappings(SEXP resHandle);
+RMySQLFields* RS_MySQL_createDataMappings(MYSQL_RES* my_result, cetype_t encoding);
+
+// Decoding --------------------------------------------------------------------
+RMySQLColumns* rmysql_columns_alloc(SEXP output, RMySQLFields* flds, int num_rows);
+int rmysql_columns_decode(RMySQLColumns* cols, MYSQL_RES* my_result, int max_rows);
+int rmysql_columns_decode_parallel(RMySQLColumns* cols, MYSQL_RES* my_result, int num_threads);
+void rmysql_columns_finish(RMySQLColumns* cols, SEXP output);
+void rmysql_columns_free(RMySQLColumns* cols);
+
+// Column files ----------------------------------------------------------------
+SEXP rmysql_column_file_write(SEXP df, SEXP s_path, SEXP s_key, SEXP s_tables, SEXP s_expires);
+SEXP rmysql_column_file_read(SEXP s_path, SEXP s_key);
+SEXP rmysql_column_file_info(SEXP s_path);
+SEXP rmysql_column_file_dir(SEXP s_path, SEXP s_create);
+SEXP rmysql_hash(SEXP string);
 
 // Utilities -------------------------------------------------------------------
 char *RS_DBI_copyString(const char* str);
 SEXP RS_DBI_createNamedList(char** names, SEXPTYPE* types, int* lengths, int n);
 void RS_na_set(void* ptr, SEXPTYPE type);
 int RS_is_na(void* ptr, SEXPTYPE type);
-SEXP rmysql_escape_strings(SEXP conHandle, SEXP statement);
+int RS_DBI_interrupted(void);
+SEXP rmysql_mkchar(const char* value, unsigned long len, cetype_t encoding, int* truncated);
+SEXP rmysql_escape_strings(SEXP conHandle, SEXP strings);
+SEXP rmysql_quote_strings(SEXP conHandle, SEXP strings);
 
 // Object database -------------------------------------------------------------
 // Simple object database used for storing all connections for a driver,
@@ -0,0 +1,526 @@
+#include "RS-MySQL.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef WIN32
+# include <unistd.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+#else
+# include <direct.h>
+#endif
+
+/* Data frames saved as column files, for caches shared between processes.
+ *
+ * A column file holds a data frame of integer, double, logical and
+ * character columns in the layout R keeps them in memory, so that reading
+ * one back is mostly copying from a mapping of the file: no parsing, and
+ * no round trip to the server. Files are written beside their final path
+ * and renamed over it, so a reader sees either the old file or the new
+ * one, never a partial one (and keeps its mapping of the old one if it's
+ * replaced or removed while being read).
+ *
+ * Layout (native byte order, sections aligned on 8 bytes):
+ *
+ *   RMySQLFileHeader, then the key and tables strings
+ *   RMySQLFileColumn for each column, then the column names
+ *   the data of each column:
+ *     integer and logical: int32 values
+ *     double: double values
+ *     character: uint64 end offsets into the bytes, one encoding byte per
+ *       string (RMYSQL_FILE_NA for NA), then the bytes
+ *
+ * The key is checked on reading, so that a file name (a hash of the key)
+ * can't give back another statement's result. Directories of column files
+ * must be private to the user (see rmysql_column_file_dir), so that nobody
+ * else can plant files in them or redirect writes through symlinks.
+ */
+
+#define RMYSQL_FILE_MAGIC "RMySQLcf"
+#define RMYSQL_FILE_VERSION 1
+#define RMYSQL_FILE_ORDER 0x01020304
+#define RMYSQL_FILE_NA 255
+
+typedef struct RMySQLFileHeader {
+  char magic[8];
+  uint32_t byte_order;     // RMYSQL_FILE_ORDER as written
+  uint32_t version;
+  double expires;          // seconds since the epoch
+  uint64_t size;           // of the whole file, to catch truncation
+  int64_t num_rows;
+  int32_t num_fields;
+  uint32_t key_len;
+  uint32_t tables_len;     // table names, separated by newlines
+  uint32_t reserved;
+} RMySQLFileHeader;
+
+typedef struct RMySQLFileColumn {
+  int32_t type;            // SEXPTYPE
+  uint32_t name_len;
+  uint64_t name;           // offsets from the start of the file
+  uint64_t data;
+} RMySQLFileColumn;
+
+static uint64_t rmysql_pad8(uint64_t n) {
+  return (n + 7) & ~(uint64_t) 7;
+}
+
+static uint64_t rmysql_column_bytes(SEXP col, int64_t num_rows) {
+  switch(TYPEOF(col)) {
+  case INTSXP:
+  case LGLSXP:
+    return rmysql_pad8(num_rows * sizeof(int32_t));
+  case REALSXP:
+    return num_rows * sizeof(double);
+  default: {
+    uint64_t bytes = 0;
+    for (int64_t i = 0; i < num_rows; i++) {
+      SEXP string = STRING_ELT(col, i);
+      if (string != NA_STRING)
+        bytes += LENGTH(string);
+    }
+    return num_rows * sizeof(uint64_t) + rmysql_pad8(num_rows) + rmysql_pad8(bytes);
+  }
+  }
+}
+
+static int rmysql_write_pad(FILE* file, uint64_t written) {
+  static const char zeros[8] = {0};
+  size_t pad = (size_t) (rmysql_pad8(written) - written);
+  return pad == 0 || fwrite(zeros, 1, pad, file) == pad;
+}
+
+static int rmysql_write_strings(FILE* file, SEXP col, int64_t num_rows) {
+  uint64_t end = 0;
+  for (int64_t i = 0; i < num_rows; i++) {
+    SEXP string = STRING_ELT(col, i);
+    if (string != NA_STRING)
+      end += LENGTH(string);
+    if (fwrite(&end, sizeof(end), 1, file) != 1)
+      return 1;
+  }
+  for (int64_t i = 0; i < num_rows; i++) {
+    SEXP string = STRING_ELT(col, i);
+    unsigned char ce = string == NA_STRING ? RMYSQL_FILE_NA :
+      (unsigned char) getCharCE(string);
+    if (fputc(ce, file) == EOF)
+      return 1;
+  }
+  if (!rmysql_write_pad(file, num_rows))
+    return 1;
+  for (int64_t i = 0; i < num_rows; i++) {
+    SEXP string = STRING_ELT(col, i);
+    if (string == NA_STRING || LENGTH(string) == 0)
+      continue;
+    if (fwrite(CHAR(string), 1, LENGTH(string), file) != (size_t) LENGTH(string))
+      return 1;
+  }
+  return !rmysql_write_pad(file, end);
+}
+
+/* Save data frame df as the column file at path, replacing any file there
+ * in one step. Returns FALSE, writing nothing, if df has columns of other
+ * types (or with attributes, e.g. factors and dates).
+ */
+SEXP rmysql_column_file_write(SEXP df, SEXP s_path, SEXP s_key, SEXP s_tables,
+                              SEXP s_expires) {
+  int n = length(df);
+  int64_t num_rows = n > 0 ? XLENGTH(VECTOR_ELT(df, 0)) : 0;
+  SEXP names = getAttrib(df, R_NamesSymbol);
+  if (n == 0 || length(names) != n)
+    return ScalarLogical(FALSE);
+
+  for (int j = 0; j < n; j++) {
+    SEXP col = VECTOR_ELT(df, j);
+    SEXPTYPE type = TYPEOF(col);
+    if (type != INTSXP && type != REALSXP && type != LGLSXP && type != STRSXP)
+      return ScalarLogical(FALSE);
+    if (ATTRIB(col) != R_NilValue || XLENGTH(col) != num_rows)
+      return ScalarLogical(FALSE);
+  }
+
+  const char* path = translateChar(STRING_ELT(s_path, 0));
+  const char* key = translateCharUTF8(STRING_ELT(s_key, 0));
+  const char* tables = translateCharUTF8(STRING_ELT(s_tables, 0));
+
+  RMySQLFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RMYSQL_FILE_MAGIC, 8);
+  header.byte_order = RMYSQL_FILE_ORDER;
+  header.version = RMYSQL_FILE_VERSION;
+  header.expires = asReal(s_expires);
+  header.num_rows = num_rows;
+  header.num_fields = n;
+  header.key_len = (uint32_t) strlen(key);
+  header.tables_len = (uint32_t) strlen(tables);
+
+  // Lay the file out before writing any of it
+  RMySQLFileColumn* columns = (RMySQLFileColumn *) R_alloc(n, sizeof(RMySQLFileColumn));
+  const char** column_names = (const char **) R_alloc(n, sizeof(char *));
+  uint64_t offset = sizeof(header) + rmysql_pad8(header.key_len + header.tables_len);
+  offset += n * sizeof(RMySQLFileColumn);
+  uint64_t names_start = offset;
+  for (int j = 0; j < n; j++) {
+    column_names[j] = translateCharUTF8(STRING_ELT(names, j));
+    columns[j].type = TYPEOF(VECTOR_ELT(df, j));
+    columns[j].name_len = (uint32_t) strlen(column_names[j]);
+    columns[j].name = offset;
+    offset += columns[j].name_len;
+  }
+  uint64_t names_len = offset - names_start;
+  offset = rmysql_pad8(offset);
+  for (int j = 0; j < n; j++) {
+    columns[j].data = offset;
+    offset += rmysql_column_bytes(VECTOR_ELT(df, j), num_rows);
+  }
+  header.size = offset;
+
+  size_t tmp_len = strlen(path) + 32;
+  char* tmp = R_alloc(tmp_len, 1);
+#ifndef WIN32
+  // Created afresh (never through a symlink), readable by the user only
+  snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (!file) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmp);
+    }
+    error("could not create %s", tmp);
+  }
+#else
+  snprintf(tmp, tmp_len, "%s.%lu.tmp", path, (unsigned long) GetCurrentProcessId());
+  FILE* file = fopen(tmp, "wb");
+  if (!file)
+    error("could not create %s", tmp);
+#endif
+
+  int failed =
+    fwrite(&header, sizeof(header), 1, file) != 1 ||
+    fwrite(key, 1, header.key_len, file) != header.key_len ||
+    fwrite(tables, 1, header.tables_len, file) != header.tables_len ||
+    !rmysql_write_pad(file, header.key_len + header.tables_len) ||
+    fwrite(columns, sizeof(RMySQLFileColumn), n, file) != (size_t) n;
+  for (int j = 0; j < n && !failed; j++)
+    failed = fwrite(column_names[j], 1, columns[j].name_len, file) != columns[j].name_len;
+  if (!failed)
+    failed = !rmysql_write_pad(file, names_start + names_len);
+
+  for (int j = 0; j < n && !failed; j++) {
+    SEXP col = VECTOR_ELT(df, j);
+    switch(TYPEOF(col)) {
+    case INTSXP:
+    case LGLSXP:
+      failed = fwrite(INTEGER(col), sizeof(int32_t), num_rows, file) != (size_t) num_rows ||
+        !rmysql_write_pad(file, num_rows * sizeof(int32_t));
+      break;
+    case REALSXP:
+      failed = fwrite(REAL(col), sizeof(double), num_rows, file) != (size_t) num_rows;
+      break;
+    default:
+      failed = rmysql_write_strings(file, col, num_rows);
+      break;
+    }
+  }
+
+  if (fclose(file) || failed) {
+    remove(tmp);
+    error("could not write %s", tmp);
+  }
+#ifndef WIN32
+  if (rename(tmp, path)) {
+#else
+  // rename() won't replace a file on Windows
+  if (!MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+#endif
+    remove(tmp);
+    error("could not rename %s to %s", tmp, path);
+  }
+
+  return ScalarLogical(TRUE);
+}
+
+/* Can column files be kept in directory s_path? It must be a directory
+ * (not a symlink to one) owned by the user, with no access for anyone
+ * else. If it doesn't exist, it's created that way when s_create is TRUE;
+ * otherwise returns FALSE. Signals an error if it exists but isn't private.
+ */
+SEXP rmysql_column_file_dir(SEXP s_path, SEXP s_create) {
+  const char* path = translateChar(STRING_ELT(s_path, 0));
+#ifndef WIN32
+  struct stat st;
+  if (lstat(path, &st)) {
+    if (errno != ENOENT || !asLogical(s_create))
+      return ScalarLogical(FALSE);
+    if (mkdir(path, 0700) && errno != EEXIST)
+      error("could not create %s", path);
+    if (lstat(path, &st))
+      error("could not create %s", path);
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+    error("%s must be a directory owned by the user, with mode 0700", path);
+  return ScalarLogical(TRUE);
+#else
+  struct stat st;
+  if (stat(path, &st)) {
+    if (!asLogical(s_create))
+      return ScalarLogical(FALSE);
+    if (_mkdir(path) && errno != EEXIST)
+      error("could not create %s", path);
+  }
+  return ScalarLogical(TRUE);
+#endif
+}
+
+// A read-only view of a whole column file
+typedef struct RMySQLFileMap {
+  const char *data;
+  uint64_t size;
+} RMySQLFileMap;
+
+// Returns non-zero if path can't be opened (e.g. it doesn't exist)
+static int rmysql_file_map(const char* path, RMySQLFileMap* map) {
+#ifndef WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 1;
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(RMySQLFileHeader)) {
+    close(fd);
+    return 1;
+  }
+  void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 1;
+
+  map->data = (const char *) data;
+  map->size = (uint64_t) st.st_size;
+  return 0;
+#else
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return 1;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* data = size >= (long) sizeof(RMySQLFileHeader) ? malloc(size) : NULL;
+  if (!data || fread(data, 1, size, file) != (size_t) size) {
+    free(data);
+    fclose(file);
+    return 1;
+  }
+  fclose(file);
+
+  map->data = data;
+  map->size = (uint64_t) size;
+  return 0;
+#endif
+}
+
+static void rmysql_file_unmap(RMySQLFileMap* map) {
+#ifndef WIN32
+  munmap((void *) map->data, (size_t) map->size);
+#else
+  free((void *) map->data);
+#endif
+}
+
+// The header of map, if it's a complete column file
+static const RMySQLFileHeader* rmysql_file_header(RMySQLFileMap* map) {
+  const RMySQLFileHeader* header = (const RMySQLFileHeader *) map->data;
+
+  if (memcmp(header->magic, RMYSQL_FILE_MAGIC, 8) ||
+      header->byte_order != RMYSQL_FILE_ORDER ||
+      header->version != RMYSQL_FILE_VERSION ||
+      header->size != map->size ||
+      header->num_rows < 0 || header->num_rows > R_XLEN_T_MAX ||
+      header->num_fields <= 0)
+    return NULL;
+
+  uint64_t columns = sizeof(RMySQLFileHeader) +
+    rmysql_pad8((uint64_t) header->key_len + header->tables_len);
+  if (columns + header->num_fields * sizeof(RMySQLFileColumn) > map->size)
+    return NULL;
+  return header;
+}
+
+static SEXP rmysql_file_strings(RMySQLFileMap* map, uint64_t offset,
+                                int64_t num_rows) {
+  if (offset + num_rows * (sizeof(uint64_t) + 1) > map->size)
+    return R_NilValue;
+
+  const uint64_t* ends = (const uint64_t *) (map->data + offset);
+  const unsigned char* ce = (const unsigned char *) (ends + num_rows);
+  uint64_t bytes_start = offset + num_rows * sizeof(uint64_t) + rmysql_pad8(num_rows);
+  const char* bytes = map->data + bytes_start;
+  if (num_rows > 0 && bytes_start + ends[num_rows - 1] > map->size)
+    return R_NilValue;
+
+  SEXP col = PROTECT(allocVector(STRSXP, num_rows));
+  uint64_t start = 0;
+  for (int64_t i = 0; i < num_rows; i++) {
+    if (ends[i] < start || (ce[i] != RMYSQL_FILE_NA && ce[i] > CE_BYTES)) {
+      UNPROTECT(1);
+      return R_NilValue;
+    }
+    if (ce[i] == RMYSQL_FILE_NA) {
+      SET_STRING_ELT(col, i, NA_STRING);
+    } else {
+      SET_STRING_ELT(col, i, mkCharLenCE(bytes + start, (int) (ends[i] - start),
+        (cetype_t) ce[i]));
+    }
+    start = ends[i];
+  }
+  UNPROTECT(1);
+  return col;
+}
+
+static SEXP rmysql_file_read(RMySQLFileMap* map, SEXP s_key) {
+  const RMySQLFileHeader* header = rmysql_file_header(map);
+  if (!header)
+    return R_NilValue;
+
+  const char* key = map->data + sizeof(RMySQLFileHeader);
+  if (s_key != R_NilValue) {
+    const char* expected = translateCharUTF8(STRING_ELT(s_key, 0));
+    if (strlen(expected) != header->key_len || memcmp(expected, key, header->key_len))
+      return R_NilValue;
+    if (header->expires <= (double) time(NULL))
+      return R_NilValue;
+  }
+
+  int n = header->num_fields;
+  int64_t num_rows = header->num_rows;
+  const RMySQLFileColumn* columns = (const RMySQLFileColumn *) (map->data +
+    sizeof(RMySQLFileHeader) + rmysql_pad8((uint64_t) header->key_len + header->tables_len));
+
+  SEXP output = PROTECT(allocVector(VECSXP, n));
+  SEXP names = PROTECT(allocVector(STRSXP, n));
+  for (int j = 0; j < n; j++) {
+    const RMySQLFileColumn* column = &columns[j];
+    if (column->name + column->name_len > map->size) {
+      UNPROTECT(2);
+      return R_NilValue;
+    }
+    SET_STRING_ELT(names, j, mkCharLenCE(map->data + column->name,
+      (int) column->name_len, CE_UTF8));
+
+    SEXP col = R_NilValue;
+    switch(column->type) {
+    case INTSXP:
+    case LGLSXP:
+      if (column->data + num_rows * sizeof(int32_t) > map->size)
+        break;
+      col = allocVector(column->type, num_rows);
+      memcpy(INTEGER(col), map->data + column->data, num_rows * sizeof(int32_t));
+      break;
+    case REALSXP:
+      if (column->data + num_rows * sizeof(double) > map->size)
+        break;
+      col = allocVector(REALSXP, num_rows);
+      memcpy(REAL(col), map->data + column->data, num_rows * sizeof(double));
+      break;
+    case STRSXP:
+      col = rmysql_file_strings(map, column->data, num_rows);
+      break;
+    }
+    if (col == R_NilValue) {
+      UNPROTECT(2);
+      return R_NilValue;
+    }
+    SET_VECTOR_ELT(output, j, col);
+  }
+
+  SET_NAMES(output, names);
+  make_data_frame(output);
+  UNPROTECT(2);
+  return output;
+}
+
+/* The data frame in the column file at path, or NULL if there isn't one.
+ * Unless key is NULL, that's also the case if the file was written for
+ * another key or has expired.
+ */
+typedef struct RMySQLFileRead {
+  RMySQLFileMap map;
+  SEXP key;
+} RMySQLFileRead;
+
+static SEXP rmysql_file_read_run(void* data) {
+  RMySQLFileRead* read = (RMySQLFileRead *) data;
+  return rmysql_file_read(&read->map, read->key);
+}
+
+static void rmysql_file_read_cleanup(void* data) {
+  rmysql_file_unmap(&((RMySQLFileRead *) data)->map);
+}
+
+SEXP rmysql_column_file_read(SEXP s_path, SEXP s_key) {
+  RMySQLFileRead read;
+  if (rmysql_file_map(translateChar(STRING_ELT(s_path, 0)), &read.map))
+    return R_NilValue;
+
+  // The mapping goes whether or not building the data frame succeeds
+  read.key = s_key;
+  return R_ExecWithCleanup(rmysql_file_read_run, &read,
+    rmysql_file_read_cleanup, &read);
+}
+
+/* The key, tables and expiry time of the column file at path, or NULL if
+ * it isn't one. Only reads the header.
+ */
+SEXP rmysql_column_file_info(SEXP s_path) {
+  FILE* file = fopen(translateChar(STRING_ELT(s_path, 0)), "rb");
+  if (!file)
+    return R_NilValue;
+
+  RMySQLFileHeader header;
+  char* strings = NULL;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, RMYSQL_FILE_MAGIC, 8) ||
+      header.byte_order != RMYSQL_FILE_ORDER ||
+      header.version != RMYSQL_FILE_VERSION) {
+    fclose(file);
+    return R_NilValue;
+  }
+  size_t len = (size_t) header.key_len + header.tables_len;
+  strings = R_alloc(len + 1, 1);
+  if (fread(strings, 1, len, file) != len) {
+    fclose(file);
+    return R_NilValue;
+  }
+  fclose(file);
+
+  SEXP output = PROTECT(allocVector(VECSXP, 3));
+  SEXP names = PROTECT(allocVector(STRSXP, 3));
+  SET_VECTOR_ELT(output, 0, ScalarString(mkCharLenCE(strings, header.key_len, CE_UTF8)));
+  SET_VECTOR_ELT(output, 1, ScalarString(mkCharLenCE(strings + header.key_len,
+    header.tables_len, CE_UTF8)));
+  SET_VECTOR_ELT(output, 2, ScalarReal(header.expires));
+  SET_STRING_ELT(names, 0, mkChar("key"));
+  SET_STRING_ELT(names, 1, mkChar("tables"));
+  SET_STRING_ELT(names, 2, mkChar("expires"));
+  SET_NAMES(output, names);
+  UNPROTECT(2);
+  return output;
+}
+
+// 64-bit FNV-1a hash of string, in hex, to name files after keys
+SEXP rmysql_hash(SEXP string) {
+  const unsigned char* p = (const unsigned char *) translateCharUTF8(STRING_ELT(string, 0));
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+
+  char out[17];
+  snprintf(out, sizeof(out), "%016llx", (unsigned long long) hash);
+  return mkString(out);
+}
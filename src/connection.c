@@ -1,17 +1,23 @@
 #include "RS-MySQL.h"
+#ifndef WIN32
+# include <unistd.h>
+#endif
+#include <ctype.h>
+#include <strings.h>
 
-/* RS_MySQL_createConnection - internal function
+// Attempts made by RS_MySQL_reconnect, waiting 250ms, 500ms, ... in between
+#define RMYSQL_RECONNECT_TRIES 4
+#define RMYSQL_RECONNECT_WAIT_MS 250
+
+// Most session statements kept by RS_MySQL_recordSession
+#define RMYSQL_MAX_SESSION 64
+
+/* RS_MySQL_connect - internal function
  *
- * Used by both RS_MySQL_newConnection and RS_MySQL_cloneConnection.
- * It is responsible for the memory associated with conParams.
+ * Opens my_connection (as returned by mysql_init) with conParams. Returns
+ * non-zero on failure, leaving the error in my_connection.
  */
-SEXP RS_MySQL_createConnection(SEXP mgrHandle, RS_MySQL_conParams *conParams) {
-  RS_DBI_connection  *con;
-  SEXP conHandle;
-  MYSQL     *my_connection;
-
-  /* Initialize MySQL connection */
-  my_connection = mysql_init(NULL);
+int RS_MySQL_connect(MYSQL* my_connection, RS_MySQL_conParams *conParams) {
   // Always enable INFILE option, since needed for dbWriteTable
   mysql_options(my_connection, MYSQL_OPT_LOCAL_INFILE, 0);
 
@@ -34,20 +40,75 @@ SEXP RS_MySQL_createConnection(SEXP mgrHandle, RS_MySQL_conParams *conParams) {
   if(conParams->default_file)
     mysql_options(my_connection, MYSQL_READ_DEFAULT_FILE, conParams->default_file);
 
+  // Without these a dead server or network can block the client forever
+  if(conParams->connect_timeout)
+    mysql_options(my_connection, MYSQL_OPT_CONNECT_TIMEOUT, &conParams->connect_timeout);
+  if(conParams->read_timeout)
+    mysql_options(my_connection, MYSQL_OPT_READ_TIMEOUT, &conParams->read_timeout);
+  if(conParams->write_timeout)
+    mysql_options(my_connection, MYSQL_OPT_WRITE_TIMEOUT, &conParams->write_timeout);
+
   if(!mysql_real_connect(my_connection,
     conParams->host, conParams->username, conParams->password, conParams->dbname,
     conParams->port, conParams->unix_socket, conParams->client_flag)){
+    return 1;
+  }
+
+  /* Have text sent in the requested character set, falling back to utf8
+   * on servers that predate utf8mb4. If neither works the server's default
+   * is kept.
+   */
+  if(conParams->charset &&
+     mysql_set_character_set(my_connection, conParams->charset) &&
+     !strcmp(conParams->charset, "utf8mb4")) {
+    mysql_set_character_set(my_connection, "utf8");
+  }
+  conParams->utf8 = !strncmp(mysql_character_set_name(my_connection), "utf8", 4);
+
+  return 0;
+}
+
+/* Encoding of the strings sent over a connection opened with conParams */
+cetype_t RS_MySQL_encoding(RS_MySQL_conParams *conParams) {
+  return conParams->utf8 ? CE_UTF8 : CE_NATIVE;
+}
+
+/* The text of x as it's sent over such a connection: translated to UTF-8
+ * (in R_alloc'd memory, unless it already is) on UTF-8 connections, else
+ * in the native encoding as before.
+ */
+const char* RS_MySQL_text(RS_MySQL_conParams *conParams, SEXP x) {
+  return conParams->utf8 ? translateCharUTF8(x) : CHAR(x);
+}
+
+/* RS_MySQL_createConnection - internal function
+ *
+ * Used by both RS_MySQL_newConnection and RS_MySQL_cloneConnection.
+ * It is responsible for the memory associated with conParams.
+ */
+SEXP RS_MySQL_createConnection(SEXP mgrHandle, RS_MySQL_conParams *conParams) {
+  RS_DBI_connection  *con;
+  SEXP conHandle;
+  MYSQL     *my_connection;
+
+  /* Initialize MySQL connection */
+  my_connection = mysql_init(NULL);
+
+  if(RS_MySQL_connect(my_connection, conParams)){
+    char msg[MYSQL_ERRMSG_SIZE];
+    strncpy(msg, mysql_error(my_connection), MYSQL_ERRMSG_SIZE - 1);
+    msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
 
+    mysql_close(my_connection);
     RS_MySQL_freeConParams(conParams);
 
-    error(
-      "Failed to connect to database: Error: %s\n",
-      mysql_error(my_connection)
-    );
+    error("Failed to connect to database: Error: %s\n", msg);
   }
 
-  /* MySQL connections can only have 1 result set open at a time */
-  conHandle = RS_DBI_allocConnection(mgrHandle, (int) 1);
+  /* MySQL connections can only stream 1 result set at a time, the others
+   * are server-side cursors (see RS_MySQL_pendingResult)
+   */
+  conHandle = RS_DBI_allocConnection(mgrHandle, (int) 16);
   con = RS_DBI_getConnection(conHandle);
   if(!con){
     mysql_close(my_connection);
@@ -57,14 +118,284 @@ SEXP RS_MySQL_createConnection(SEXP mgrHandle, RS_MySQL_conParams *conParams) {
 
   con->conParams = (void *) conParams;
   con->drvConnection = (void *) my_connection;
+  con->statements = rmysql_stmt_cache_alloc(conParams->statement_cache);
+#ifndef WIN32
+  con->pid = (int) getpid();
+#endif
 
   return conHandle;
 }
 
+/* Ask the server to stop the statement currently running on con. This has
+ * to go through a second connection, opened with the same parameters, since
+ * con itself is busy. Returns non-zero on failure.
+ */
+int RS_MySQL_killQuery(RS_DBI_connection* con) {
+  return RS_MySQL_killThread(con->conParams,
+    mysql_thread_id((MYSQL *) con->drvConnection));
+}
+
+// Ditto, for the statement running in server thread thread_id
+int RS_MySQL_killThread(RS_MySQL_conParams* conParams, unsigned long thread_id) {
+  char sql[64];
+
+  MYSQL* side_connection = mysql_init(NULL);
+  if (!side_connection)
+    return 1;
+  if (RS_MySQL_connect(side_connection, conParams)) {
+    mysql_close(side_connection);
+    return 1;
+  }
+
+  snprintf(sql, sizeof(sql), "KILL QUERY %lu", thread_id);
+  int rc = mysql_query(side_connection, sql);
+  mysql_close(side_connection);
+
+  return rc;
+}
+
+// If statement starts with keyword, return what follows it, else NULL
+static const char* rmysql_keyword(const char* statement, const char* keyword) {
+  while (isspace((unsigned char) *statement))
+    statement++;
+
+  size_t n = strlen(keyword);
+  if (strncasecmp(statement, keyword, n) || !isspace((unsigned char) statement[n]))
+    return NULL;
+  return statement + n;
+}
+
+/* Does SET ... (rest) change anything beyond the session? Those aren't
+ * replayed: doing it again on every new connection would repeat
+ * server-wide changes (and keep passwords around), and fail without the
+ * privilege to make them.
+ */
+static int rmysql_set_global(const char* rest) {
+  static const char* scopes[] = {"GLOBAL", "PERSIST", "PERSIST_ONLY", "PASSWORD"};
+  while (isspace((unsigned char) *rest))
+    rest++;
+  for (size_t i = 0; i < sizeof(scopes) / sizeof(scopes[0]); i++) {
+    size_t n = strlen(scopes[i]);
+    if (!strncasecmp(rest, scopes[i], n) &&
+        !isalnum((unsigned char) rest[n]) && rest[n] != '_')
+      return 1;
+  }
+
+  static const char* prefixes[] = {"@@global.", "@@persist.", "@@persist_only."};
+  for (const char* p = strstr(rest, "@@"); p; p = strstr(p + 2, "@@")) {
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+      if (!strncasecmp(p, prefixes[i], strlen(prefixes[i])))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/* What a recorded statement sets, as a lower case key in a buffer of size
+ * bytes: "use" for USE, else the variable before the "=" (without
+ * SESSION, LOCAL or @@session.), or the first word for SET NAMES and the
+ * like. A statement setting several variables keys on all of its text.
+ */
+static void rmysql_session_key(const char* statement, char* key, size_t size) {
+  static const char* prefixes[] = {"session ", "local ", "@@session.", "@@local.", "@@"};
+  const char* rest = rmysql_keyword(statement, "SET");
+  if (!rest) {
+    snprintf(key, size, "use");
+    return;
+  }
+
+  while (isspace((unsigned char) *rest))
+    rest++;
+  size_t len = strcspn(rest, "=:");
+  if (strchr(rest, ','))
+    len = strlen(rest);
+  else if (!rest[len])
+    len = strcspn(rest, " \t\r\n");
+
+  size_t n = 0;
+  for (size_t i = 0; i < len && n + 1 < size; i++) {
+    if (i == 0 || isspace((unsigned char) rest[i - 1])) {
+      for (size_t j = 0; j < sizeof(prefixes) / sizeof(prefixes[0]); j++) {
+        size_t k = strlen(prefixes[j]);
+        if (i + k <= len && !strncasecmp(rest + i, prefixes[j], k)) {
+          i += k;
+          break;
+        }
+      }
+      if (i >= len)
+        break;
+    }
+    if (!isspace((unsigned char) rest[i]))
+      key[n++] = (char) tolower((unsigned char) rest[i]);
+  }
+  key[n] = '\0';
+}
+
+/* Remember statements that change the state of the session (SET ... and
+ * USE ...), so that RS_MySQL_replaySession can restore it on a new
+ * connection (after a reconnect, in a forked child, or on the clones that
+ * read a table in parallel). SET TRANSACTION only applies to the next
+ * transaction and SET STATEMENT ... FOR to its own statement, so they
+ * aren't kept, and neither are batches of statements or SETs reaching
+ * beyond the session (see rmysql_set_global).
+ *
+ * A statement replaces an earlier one setting the same thing (see
+ * rmysql_session_key), and goes to the end so that the latest value wins.
+ * At most RMYSQL_MAX_SESSION are kept, dropping the oldest SET first.
+ */
+void RS_MySQL_recordSession(RS_MySQL_conParams *conParams, const char* statement) {
+  if (strchr(statement, ';'))
+    return;
+
+  const char* rest = rmysql_keyword(statement, "SET");
+  if (rest) {
+    if (rmysql_keyword(rest, "TRANSACTION") || rmysql_keyword(rest, "STATEMENT") ||
+        rmysql_set_global(rest))
+      return;
+  } else if (!rmysql_keyword(statement, "USE")) {
+    return;
+  }
+
+  char key[256], other[256];
+  rmysql_session_key(statement, key, sizeof(key));
+
+  int drop = -1;
+  for (int i = 0; i < conParams->num_session; i++) {
+    rmysql_session_key(conParams->session[i], other, sizeof(other));
+    if (!strcmp(key, other)) {
+      drop = i;
+      break;
+    }
+  }
+  if (drop < 0 && conParams->num_session >= RMYSQL_MAX_SESSION) {
+    for (int i = 0; i < conParams->num_session && drop < 0; i++) {
+      if (rmysql_keyword(conParams->session[i], "SET"))
+        drop = i;
+    }
+  }
+
+  char* copy = malloc(strlen(statement) + 1);
+  if (!copy)
+    return;
+  strcpy(copy, statement);
+
+  if (drop >= 0) {
+    free(conParams->session[drop]);
+    memmove(conParams->session + drop, conParams->session + drop + 1,
+      (conParams->num_session - drop - 1) * sizeof(char *));
+    conParams->session[conParams->num_session - 1] = copy;
+    return;
+  }
+
+  char** session = realloc(conParams->session,
+    (conParams->num_session + 1) * sizeof(char *));
+  if (!session) {
+    free(copy);
+    return;
+  }
+  conParams->session = session;
+  conParams->session[conParams->num_session++] = copy;
+}
+
+// Returns non-zero if any of the recorded statements fails
+int RS_MySQL_replaySession(MYSQL* my_connection, RS_MySQL_conParams *conParams) {
+  for (int i = 0; i < conParams->num_session; i++) {
+    const char* statement = conParams->session[i];
+    if (mysql_real_query(my_connection, statement, (unsigned long) strlen(statement)))
+      return 1;
+    MYSQL_RES* my_result = mysql_store_result(my_connection);
+    if (my_result)
+      mysql_free_result(my_result);
+  }
+  return 0;
+}
+
+static void rmysql_sleep(int ms) {
+#ifdef WIN32
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+/* Forget the result sets open on con, as the handle they were read from is
+ * going away. With release, their client-side results and statements are
+ * freed too (which may read from the handle); without, they're abandoned.
+ */
+static void rmysql_connection_drop_results(RS_DBI_connection* con, int release) {
+  for (int i = 0; i < con->length; i++) {
+    RS_DBI_resultSet* result = con->resultSets[i];
+    if (con->resultSetIds[i] < 0 || !result)
+      continue;
+
+    if (release && result->drvResultSet)
+      mysql_free_result((MYSQL_RES *) result->drvResultSet);
+    if (release && result->drvStatement)
+      mysql_stmt_close((MYSQL_STMT *) result->drvStatement);
+    if (result->drvBinds)
+      rmysql_binds_free((RMySQLBinds *) result->drvBinds);
+    if (result->statement)
+      free(result->statement);
+    if (result->fields)
+      rmysql_fields_free(result->fields);
+    free(result);
+
+    RS_DBI_freeEntry(con->resultSetIds, i);
+    con->resultSets[i] = NULL;
+  }
+  con->num_res = 0;
+}
+
+/* Replace the connection to a server that went away with a new one, opened
+ * with the same parameters and session settings. Tries a few times, backing
+ * off in between. Returns non-zero on failure, leaving con as it was.
+ *
+ * Results and cursors opened on the old connection are dropped (and can
+ * no longer be read from), as are cached prepared statements.
+ */
+int RS_MySQL_reconnect(RS_DBI_connection* con) {
+  RS_MySQL_conParams* conParams = (RS_MySQL_conParams *) con->conParams;
+  int wait = RMYSQL_RECONNECT_WAIT_MS;
+
+  for (int i = 0; i < RMYSQL_RECONNECT_TRIES; i++) {
+    if (i > 0) {
+      rmysql_sleep(wait);
+      wait *= 2;
+    }
+
+    MYSQL* my_connection = mysql_init(NULL);
+    if (!my_connection)
+      continue;
+    if (RS_MySQL_connect(my_connection, conParams) ||
+        RS_MySQL_replaySession(my_connection, conParams)) {
+      mysql_close(my_connection);
+      continue;
+    }
+
+    rmysql_connection_drop_results(con, 1);
+    if (con->statements)
+      rmysql_stmt_cache_clear(con->statements, 1);
+    mysql_close((MYSQL *) con->drvConnection);
+    con->drvConnection = (void *) my_connection;
+    return 0;
+  }
+
+  return 1;
+}
+
 SEXP RS_DBI_allocConnection(SEXP mgrHandle, int max_res) {
   MySQLDriver* mgr = rmysql_driver();
 
+  // Reserve the entry before letting go of the lock
+  rmysql_driver_lock();
+  int con_id = mgr->counter;
   int indx = RS_DBI_newEntry(mgr->connectionIds, mgr->length);
+  if (indx >= 0) {
+    mgr->connectionIds[indx] = con_id;
+    mgr->counter += 1;
+  }
+  rmysql_driver_unlock();
+
   if (indx < 0) {
     error(
       "Cannot allocate a new connection: %d connections already opened",
@@ -77,10 +408,11 @@ SEXP RS_DBI_allocConnection(SEXP mgrHandle, int max_res) {
     error("Could not allocate memory for connection");
   }
 
-  int con_id = mgr->counter;
   con->connectionId = con_id;
   con->drvConnection = (void *) NULL;
   con->conParams = (void *) NULL;
+  con->pid = 0;
+  con->statements = NULL;
   con->counter = (int) 0;
   con->length = max_res; /* length of resultSet vector */
 
@@ -101,10 +433,10 @@ SEXP RS_DBI_allocConnection(SEXP mgrHandle, int max_res) {
   }
 
   /* Finally, update connection table in mgr */
+  rmysql_driver_lock();
   mgr->num_con += 1;
-  mgr->counter += 1;
   mgr->connections[indx] = con;
-  mgr->connectionIds[indx] = con_id;
+  rmysql_driver_unlock();
   SEXP conHandle = RS_DBI_asConHandle(MGR_ID(mgrHandle), con_id);
   return conHandle;
 }
@@ -124,7 +456,10 @@ void RS_DBI_freeConnection(SEXP conHandle) {
     int  i;
     SEXP rsHandle;
 
-    for(i=0; i < con->num_res; i++){
+    /* The table has holes where results were cleared */
+    for(i=0; i < con->length; i++){
+      if (con->resultSetIds[i] < 0)
+        continue;
       rsHandle = RS_DBI_asResHandle(con->managerId,
         con->connectionId,
         (int) con->resultSetIds[i]);
@@ -143,10 +478,12 @@ void RS_DBI_freeConnection(SEXP conHandle) {
   if(con->resultSetIds) free(con->resultSetIds);
 
   /* update the manager's connection table */
+  rmysql_driver_lock();
   indx = RS_DBI_lookup(mgr->connectionIds, mgr->length, con->connectionId);
   RS_DBI_freeEntry(mgr->connectionIds, indx);
   mgr->connections[indx] = (RS_DBI_connection *) NULL;
   mgr->num_con -= (int) 1;
+  rmysql_driver_unlock();
 
   free(con);
   con = (RS_DBI_connection *) NULL;
@@ -164,17 +501,58 @@ SEXP RS_DBI_asConHandle(int mgrId, int conId) {
   return conHandle;
 }
 
+#ifndef WIN32
+/* A forked child (e.g. from parallel::mclapply) inherits its parent's
+ * sockets: using them would interleave both processes' packets on one
+ * session, and closing them would end the parent's session. So the child
+ * abandons the inherited connection, and any results read from it, without
+ * touching the socket and opens its own with the same parameters.
+ */
+static void rmysql_connection_forked(RS_DBI_connection* con) {
+  // Freeing drvResultSet or drvStatement could read from the socket
+  rmysql_connection_drop_results(con, 0);
+
+  // Closing the parent's prepared statements would also go through the socket
+  if (con->statements)
+    rmysql_stmt_cache_clear(con->statements, 0);
+
+  MYSQL* my_connection = mysql_init(NULL);
+  if (!my_connection)
+    error("Failed to reconnect in forked process: could not allocate connection");
+  if (RS_MySQL_connect(my_connection, con->conParams) ||
+      RS_MySQL_replaySession(my_connection, con->conParams)) {
+    char msg[MYSQL_ERRMSG_SIZE];
+    strncpy(msg, mysql_error(my_connection), MYSQL_ERRMSG_SIZE - 1);
+    msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+    mysql_close(my_connection);
+    error("Failed to reconnect in forked process: %s", msg);
+  }
+
+  con->drvConnection = (void *) my_connection;
+  con->pid = (int) getpid();
+}
+#endif
+
 RS_DBI_connection* RS_DBI_getConnection(SEXP conHandle) {
   MySQLDriver  *mgr;
+  RS_DBI_connection *con;
   int indx;
 
   mgr = rmysql_driver();
+  rmysql_driver_lock();
   indx = RS_DBI_lookup(mgr->connectionIds, mgr->length, CON_ID(conHandle));
+  con = indx < 0 ? NULL : mgr->connections[indx];
+  rmysql_driver_unlock();
   if(indx < 0)
     error("internal error in RS_DBI_getConnection: corrupt connection handle");
-  if(!mgr->connections[indx])
+  if(!con)
     error("internal error in RS_DBI_getConnection: corrupt connection  object");
-  return mgr->connections[indx];
+
+#ifndef WIN32
+  if(con->drvConnection && con->pid != (int) getpid())
+    rmysql_connection_forked(con);
+#endif
+  return con;
 }
 
 
@@ -182,7 +560,6 @@ SEXP RS_DBI_connectionInfo(SEXP conHandle) {
 
   RS_DBI_connection  *con;
   SEXP output;
-  int     i;
   int  n = (int) 8;
   char *conDesc[] = {"host", "user", "dbname", "conType",
     "serverVersion", "protocolVersion",
@@ -207,8 +584,7 @@ SEXP RS_DBI_connectionInfo(SEXP conHandle) {
   LST_INT_EL(output,5,0) = (int) -1;            /* protocolVersion */
   LST_INT_EL(output,6,0) = (int) -1;            /* threadId */
 
-  for(i=0; i < con->num_res; i++)
-    LST_INT_EL(output,7,(int) i) = con->resultSetIds[i];
+  RS_DBI_listEntries(con->resultSetIds, con->length, INTEGER(LST_EL(output,7)));
 
   return output;
 }
@@ -256,6 +632,17 @@ RS_MySQL_conParams* RS_MySQL_allocConParams(void) {
   conParams->client_flag = 0;
   conParams->groups = NULL;
   conParams->default_file = NULL;
+  conParams->interruptible = 0;
+  conParams->connect_timeout = 0;
+  conParams->read_timeout = 0;
+  conParams->write_timeout = 0;
+  conParams->reconnect = 0;
+  conParams->threads = 1;
+  conParams->statement_cache = 0;
+  conParams->charset = NULL;
+  conParams->utf8 = 0;
+  conParams->session = NULL;
+  conParams->num_session = 0;
   return conParams;
 }
 
@@ -271,6 +658,15 @@ RS_MySQL_conParams* RS_MySQL_cloneConParams(RS_MySQL_conParams *cp) {
   new->client_flag = cp->client_flag;
   if (cp->groups) new->groups = RS_DBI_copyString(cp->groups);
   if (cp->default_file) new->default_file = RS_DBI_copyString(cp->default_file);
+  new->interruptible = cp->interruptible;
+  new->connect_timeout = cp->connect_timeout;
+  new->read_timeout = cp->read_timeout;
+  new->write_timeout = cp->write_timeout;
+  new->reconnect = cp->reconnect;
+  new->threads = cp->threads;
+  new->statement_cache = cp->statement_cache;
+  if (cp->charset) new->charset = RS_DBI_copyString(cp->charset);
+  // the session state belongs to the connection, a clone starts afresh
 
   return new;
 }
@@ -284,6 +680,12 @@ void RS_MySQL_freeConParams(RS_MySQL_conParams *conParams) {
   /* port and client_flag are unsigned ints */
   if(conParams->groups) free(conParams->groups);
   if(conParams->default_file) free(conParams->default_file);
+  if(conParams->charset) free(conParams->charset);
+  if(conParams->session) {
+    for (int i = 0; i < conParams->num_session; i++)
+      free(conParams->session[i]);
+    free(conParams->session);
+  }
   free(conParams);
   return;
 }
@@ -291,7 +693,8 @@ void RS_MySQL_freeConParams(RS_MySQL_conParams *conParams) {
 SEXP RS_MySQL_newConnection(SEXP mgrHandle, SEXP s_dbname, SEXP s_username,
   SEXP s_password, SEXP s_myhost, SEXP s_unix_socket,
   SEXP s_port, SEXP s_client_flag, SEXP s_groups,
-  SEXP s_default_file) {
+  SEXP s_default_file, SEXP s_interruptible, SEXP s_timeouts,
+  SEXP s_reconnect, SEXP s_threads, SEXP s_charset, SEXP s_statement_cache) {
 
   RS_MySQL_conParams *conParams;
 
@@ -317,6 +720,22 @@ SEXP RS_MySQL_newConnection(SEXP mgrHandle, SEXP s_dbname, SEXP s_username,
     conParams->groups = RS_DBI_copyString(CHAR(asChar(s_groups)));
   if(s_default_file != R_NilValue)
     conParams->default_file = RS_DBI_copyString(CHAR(asChar(s_default_file)));
+  if (s_interruptible != R_NilValue)
+    conParams->interruptible = asLogical(s_interruptible) == TRUE;
+  if (s_timeouts != R_NilValue) {
+    // connect, read and write timeouts, in seconds
+    conParams->connect_timeout = INTEGER(s_timeouts)[0];
+    conParams->read_timeout = INTEGER(s_timeouts)[1];
+    conParams->write_timeout = INTEGER(s_timeouts)[2];
+  }
+  if (s_reconnect != R_NilValue)
+    conParams->reconnect = asLogical(s_reconnect) == TRUE;
+  if (s_threads != R_NilValue)
+    conParams->threads = asInteger(s_threads);
+  if (s_charset != R_NilValue)
+    conParams->charset = RS_DBI_copyString(CHAR(asChar(s_charset)));
+  if (s_statement_cache != R_NilValue)
+    conParams->statement_cache = asInteger(s_statement_cache);
 
   return RS_MySQL_createConnection(mgrHandle, conParams);
 }
@@ -336,6 +755,10 @@ SEXP RS_MySQL_closeConnection(SEXP conHandle) {
     RS_MySQL_freeConParams(con->conParams);
     con->conParams = (RS_MySQL_conParams *) NULL;
   }
+  if(con->statements){
+    rmysql_stmt_cache_free(con->statements, 1);
+    con->statements = NULL;
+  }
   my_connection = (MYSQL *) con->drvConnection;
   mysql_close(my_connection);
   con->drvConnection = (void *) NULL;
@@ -350,14 +773,18 @@ SEXP RS_MySQL_connectionInfo(SEXP conHandle) {
   RS_MySQL_conParams *conParams;
   RS_DBI_connection  *con;
   SEXP output;
-  int       i, n = 8, *res, nres;
+  int       i, n = 13, *res, nres;
   char *conDesc[] = {"host", "user", "dbname", "conType",
     "serverVersion", "protocolVersion",
-    "threadId", "rsId"};
+    "threadId", "rsId", "charset",
+    "statementCache", "statementCacheHits", "statementCacheMisses",
+    "inTransaction"};
   SEXPTYPE conType[] = {STRSXP, STRSXP, STRSXP,
     STRSXP, STRSXP, INTSXP,
-    INTSXP, INTSXP};
-  int  conLen[]  = {1, 1, 1, 1, 1, 1, 1, 1};
+    INTSXP, INTSXP, STRSXP,
+    INTSXP, REALSXP, REALSXP,
+    LGLSXP};
+  int  conLen[]  = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
   char *tmp;
 
   con = RS_DBI_getConnection(conHandle);
@@ -390,6 +817,13 @@ SEXP RS_MySQL_connectionInfo(SEXP conHandle) {
   for( i = 0; i < con->num_res; i++){
     LST_INT_EL(output,7,i) = (int) res[i];
   }
+  SET_LST_CHR_EL(output,8,0,mkChar(mysql_character_set_name(my_con)));
+  LST_INT_EL(output,9,0) = con->statements ? con->statements->size : 0;
+  LST_NUM_EL(output,10,0) = con->statements ? con->statements->hits : 0;
+  LST_NUM_EL(output,11,0) = con->statements ? con->statements->misses : 0;
+  // Whether what's written isn't committed yet, as of the last statement
+  LOGICAL(LST_EL(output,12))[0] = (my_con->server_status & SERVER_STATUS_IN_TRANS) ||
+    !(my_con->server_status & SERVER_STATUS_AUTOCOMMIT);
   UNPROTECT(1);
 
   return output;
@@ -1,4 +1,5 @@
 #include "RS-MySQL.h"
+#include "parse.h"
 
 /*
  * RS_MySQL_dbApply.
@@ -141,7 +142,7 @@ SEXP                                /* output is a named list */
 
       unsigned long  *lens = (unsigned long *)0;
       SEXPTYPE  *fld_Sclass;
-      int   i, j, null_item, expand, completed;
+      int   i, j, null_item, expand, completed, truncated;
       int   num_rec, num_groups;
       int    num_fields;
       int   max_rec = INT_EL(s_max_rec,0);     /* max rec per group */
@@ -254,7 +255,7 @@ SEXP                                /* output is a named list */
             if(null_item)
               NA_SET(&(LST_INT_EL(data,j,i)), INTSXP);
             else
-              LST_INT_EL(data,j,i) = atol(row[j]);
+              LST_INT_EL(data,j,i) = rmysql_atoi(row[j], lens[j]);
             LST_INT_EL(cur_rec,j,0) = LST_INT_EL(data,j,i);
             break;
 
@@ -267,19 +268,20 @@ SEXP                                /* output is a named list */
             if(null_item)
               SET_LST_CHR_EL(data,j,i,NA_STRING);
             else {
-              if((size_t) lens[j] != strlen(row[j])){
-                warning("internal error: row %ld field %ld truncated", i, j);
-              }
-              SET_LST_CHR_EL(data,j,i,mkChar(row[j]));
+              truncated = 0;
+              SET_LST_CHR_EL(data,j,i,
+                rmysql_mkchar(row[j], lens[j], flds->encoding[j], &truncated));
+              if(truncated)
+                warning("row %d field %d truncated at embedded nul", i, j);
             }
-            SET_LST_CHR_EL(cur_rec, j, 0, mkChar(LST_CHR_EL(data,j,i)));
+            SET_LST_CHR_EL(cur_rec, j, 0, STRING_ELT(LST_EL(data,j), i));
             break;
 
           case REALSXP:
             if(null_item)
               NA_SET(&(LST_NUM_EL(data,j,i)), REALSXP);
             else
-              LST_NUM_EL(data,j,i) = (double) atof(row[j]);
+              LST_NUM_EL(data,j,i) = rmysql_atof(row[j], lens[j]);
             LST_NUM_EL(cur_rec,j,0) = LST_NUM_EL(data,j,i);
             break;
 
@@ -288,9 +290,13 @@ SEXP                                /* output is a named list */
               SET_LST_CHR_EL(data,j,i, NA_STRING);
             else {
               warning("unrecognized field type %d in column %d", fld_Sclass[j], j);
-              SET_LST_CHR_EL(data,j,i,mkChar(row[j]));
+              truncated = 0;
+              SET_LST_CHR_EL(data,j,i,
+                rmysql_mkchar(row[j], lens[j], flds->encoding[j], &truncated));
+              if(truncated)
+                warning("row %d field %d truncated at embedded nul", i, j);
             }
-            SET_LST_CHR_EL(cur_rec,j,0, mkChar(LST_CHR_EL(data,j,i)));
+            SET_LST_CHR_EL(cur_rec,j,0, STRING_ELT(LST_EL(data,j), i));
             break;
           }
         }
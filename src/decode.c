@@ -0,0 +1,321 @@
+#include "RS-MySQL.h"
+#include "parse.h"
+
+/* Reading a stored result into a data frame happens in three steps, so that
+ * the bulk of the work can run away from the R thread:
+ *
+ * 1. rmysql_columns_alloc (R thread) allocates the output vectors and
+ *    records where their data lives.
+ * 2. rmysql_columns_decode converts rows into that memory without calling
+ *    into R, so it may run on any thread. Strings are only located, not
+ *    copied. rmysql_columns_decode_parallel splits the numbers of a large
+ *    result across several threads.
+ * 3. rmysql_columns_finish (R thread) turns the strings into CHARSXPs. The
+ *    result must not be freed before this.
+ */
+
+typedef struct RMySQLColumnsAlloc {
+  SEXP output;
+  RMySQLFields *flds;
+  int num_rows;
+  RMySQLColumns *cols;       // NULL once the output is allocated
+} RMySQLColumnsAlloc;
+
+static SEXP rmysql_columns_output(void* data) {
+  RMySQLColumnsAlloc* alloc = (RMySQLColumnsAlloc *) data;
+  RS_DBI_allocOutput(alloc->output, alloc->flds, alloc->num_rows, 0);
+  alloc->cols = NULL;
+  return R_NilValue;
+}
+
+static void rmysql_columns_output_cleanup(void* data) {
+  RMySQLColumnsAlloc* alloc = (RMySQLColumnsAlloc *) data;
+  rmysql_fields_free(alloc->flds);
+  if (alloc->cols)
+    rmysql_columns_free(alloc->cols);
+}
+
+/* flds is freed, whether or not this succeeds */
+RMySQLColumns* rmysql_columns_alloc(SEXP output, RMySQLFields* flds, int num_rows) {
+  int n = flds->num_fields;
+
+  RMySQLColumns* cols = malloc(sizeof(RMySQLColumns));
+  if (!cols) {
+    rmysql_fields_free(flds);
+    error("Could not allocate memory for columns");
+  }
+
+  cols->num_fields = n;
+  cols->num_rows = 0;
+  cols->capacity = num_rows;
+  cols->Sclass =  calloc(n, sizeof(SEXPTYPE));
+  cols->ints =    calloc(n, sizeof(int *));
+  cols->reals =   calloc(n, sizeof(double *));
+  cols->chars =   calloc(n, sizeof(char **));
+  cols->lengths = calloc(n, sizeof(unsigned long *));
+  cols->encoding = calloc(n, sizeof(cetype_t));
+  int ok = cols->Sclass && cols->ints && cols->reals && cols->chars &&
+    cols->lengths && cols->encoding;
+
+  for (int j = 0; ok && j < n; j++) {
+    cols->Sclass[j] = flds->Sclass[j];
+    cols->encoding[j] = flds->encoding[j];
+    if (cols->Sclass[j] != INTSXP && cols->Sclass[j] != REALSXP) {
+      cols->chars[j] = malloc(num_rows * sizeof(char *) + 1);
+      cols->lengths[j] = malloc(num_rows * sizeof(unsigned long) + 1);
+      ok = cols->chars[j] && cols->lengths[j];
+    }
+  }
+  if (!ok) {
+    rmysql_fields_free(flds);
+    rmysql_columns_free(cols);
+    error("Could not allocate memory for columns");
+  }
+
+  // Allocating the output may fail too, and must not take cols and flds with it
+  RMySQLColumnsAlloc alloc;
+  alloc.output = output;
+  alloc.flds = flds;
+  alloc.num_rows = num_rows;
+  alloc.cols = cols;
+  R_ExecWithCleanup(rmysql_columns_output, &alloc,
+    rmysql_columns_output_cleanup, &alloc);
+
+  for (int j = 0; j < n; j++) {
+    if (cols->Sclass[j] == INTSXP)
+      cols->ints[j] = INTEGER(VECTOR_ELT(output, j));
+    else if (cols->Sclass[j] == REALSXP)
+      cols->reals[j] = REAL(VECTOR_ELT(output, j));
+  }
+
+  return cols;
+}
+
+void rmysql_columns_free(RMySQLColumns* cols) {
+  if (cols->chars) {
+    for (int j = 0; j < cols->num_fields; j++) {
+      if (cols->chars[j])
+        free(cols->chars[j]);
+    }
+    free(cols->chars);
+  }
+  if (cols->lengths) {
+    for (int j = 0; j < cols->num_fields; j++) {
+      if (cols->lengths[j])
+        free(cols->lengths[j]);
+    }
+    free(cols->lengths);
+  }
+  if (cols->Sclass) free(cols->Sclass);
+  if (cols->encoding) free(cols->encoding);
+  if (cols->ints) free(cols->ints);
+  if (cols->reals) free(cols->reals);
+  free(cols);
+}
+
+// Fewest rows worth handing to a decoding thread of their own
+#define RMYSQL_ROWS_PER_THREAD 10000
+#define RMYSQL_MAX_THREADS 64
+
+static int rmysql_has_numbers(RMySQLColumns* cols) {
+  for (int j = 0; j < cols->num_fields; j++) {
+    if (cols->Sclass[j] == INTSXP || cols->Sclass[j] == REALSXP)
+      return 1;
+  }
+  return 0;
+}
+
+static void rmysql_decode_numbers(RMySQLColumns* cols, MYSQL_ROW row,
+                                  unsigned long* lens, int i) {
+  for (int j = 0; j < cols->num_fields; j++) {
+    switch(cols->Sclass[j]) {
+    case INTSXP:
+      if (!row[j])
+        cols->ints[j][i] = NA_INTEGER;
+      else
+        cols->ints[j][i] = rmysql_atoi(row[j], lens[j]);
+      break;
+    case REALSXP:
+      if (!row[j])
+        cols->reals[j][i] = NA_REAL;
+      else
+        cols->reals[j][i] = rmysql_atof(row[j], lens[j]);
+      break;
+    }
+  }
+}
+
+static void rmysql_locate_strings(RMySQLColumns* cols, MYSQL_ROW row,
+                                  unsigned long* lens, int i) {
+  for (int j = 0; j < cols->num_fields; j++) {
+    if (cols->Sclass[j] == INTSXP || cols->Sclass[j] == REALSXP)
+      continue;
+    cols->chars[j][i] = row[j];
+    cols->lengths[j][i] = row[j] ? lens[j] : 0;
+  }
+}
+
+/* Decode up to max_rows more rows of my_result (a stored result). Doesn't
+ * call into R. Returns the number of rows decoded, which is less than
+ * max_rows once the result (or the output) is exhausted.
+ */
+int rmysql_columns_decode(RMySQLColumns* cols, MYSQL_RES* my_result, int max_rows) {
+  int n = 0;
+
+  while (n < max_rows && cols->num_rows < cols->capacity) {
+    MYSQL_ROW row = mysql_fetch_row(my_result);
+    if (!row)
+      break;
+
+    unsigned long* lens = mysql_fetch_lengths(my_result);
+    rmysql_locate_strings(cols, row, lens, cols->num_rows);
+    rmysql_decode_numbers(cols, row, lens, cols->num_rows);
+    cols->num_rows++;
+    n++;
+  }
+
+  return n;
+}
+
+typedef struct RMySQLRange {
+  RMySQLColumns *cols;
+  MYSQL_ROW *rows;
+  unsigned long *lens;    // num_fields lengths for each of rows
+  int first;              // output row of rows[0]
+  int from, to;           // slice of rows to decode
+} RMySQLRange;
+
+static void* rmysql_decode_range(void* arg) {
+  RMySQLRange* range = (RMySQLRange *) arg;
+
+  for (int k = range->from; k < range->to; k++)
+    rmysql_decode_numbers(range->cols, range->rows[k],
+      range->lens + (size_t) k * range->cols->num_fields, range->first + k);
+  return NULL;
+}
+
+/* Decode all remaining rows of my_result, parsing numbers on up to
+ * num_threads threads. Walking the result and locating strings stays on
+ * the calling thread: the client library's row cursor isn't shared.
+ * Doesn't call into R. Returns the number of rows decoded.
+ */
+int rmysql_columns_decode_parallel(RMySQLColumns* cols, MYSQL_RES* my_result,
+                                   int num_threads) {
+  int first = cols->num_rows;
+  int max_rows = cols->capacity - first;
+
+  if (num_threads > RMYSQL_MAX_THREADS)
+    num_threads = RMYSQL_MAX_THREADS;
+  if (num_threads > max_rows / RMYSQL_ROWS_PER_THREAD)
+    num_threads = max_rows / RMYSQL_ROWS_PER_THREAD;
+  if (num_threads < 2 || !rmysql_has_numbers(cols))
+    return rmysql_columns_decode(cols, my_result, max_rows);
+
+  // The client library reuses its lengths for each row, so they're copied
+  int num_fields = cols->num_fields;
+  MYSQL_ROW* rows = malloc(max_rows * sizeof(MYSQL_ROW));
+  unsigned long* lens = malloc((size_t) max_rows * num_fields * sizeof(unsigned long));
+  if (!rows || !lens) {
+    free(rows);
+    free(lens);
+    return rmysql_columns_decode(cols, my_result, max_rows);
+  }
+
+  int n = 0;
+  for (; n < max_rows; n++) {
+    MYSQL_ROW row = mysql_fetch_row(my_result);
+    if (!row)
+      break;
+    unsigned long* row_lens = mysql_fetch_lengths(my_result);
+    rmysql_locate_strings(cols, row, row_lens, first + n);
+    rows[n] = row;
+    memcpy(lens + (size_t) n * num_fields, row_lens, num_fields * sizeof(unsigned long));
+  }
+
+  pthread_t threads[RMYSQL_MAX_THREADS];
+  RMySQLRange ranges[RMYSQL_MAX_THREADS];
+  int started[RMYSQL_MAX_THREADS];
+
+  for (int t = 0; t < num_threads; t++) {
+    ranges[t].cols = cols;
+    ranges[t].rows = rows;
+    ranges[t].lens = lens;
+    ranges[t].first = first;
+    ranges[t].from = (int) ((long) n * t / num_threads);
+    ranges[t].to = (int) ((long) n * (t + 1) / num_threads);
+
+    // The last range is done here rather than left idle waiting
+    started[t] = t < num_threads - 1 &&
+      pthread_create(&threads[t], NULL, rmysql_decode_range, &ranges[t]) == 0;
+    if (!started[t])
+      rmysql_decode_range(&ranges[t]);
+  }
+  for (int t = 0; t < num_threads; t++) {
+    if (started[t])
+      pthread_join(threads[t], NULL);
+  }
+
+  free(rows);
+  free(lens);
+  cols->num_rows += n;
+  return n;
+}
+
+/* Create the strings of the rows decoded so far, and release cols. Rows
+ * that weren't decoded are left out of output.
+ */
+typedef struct RMySQLColumnsFinish {
+  RMySQLColumns *cols;
+  SEXP output;
+  int truncated;
+} RMySQLColumnsFinish;
+
+static void rmysql_columns_finish_cleanup(void* data) {
+  rmysql_columns_free(((RMySQLColumnsFinish *) data)->cols);
+}
+
+static SEXP rmysql_columns_strings(void* data) {
+  RMySQLColumnsFinish* finish = (RMySQLColumnsFinish *) data;
+  RMySQLColumns* cols = finish->cols;
+  SEXP output = finish->output;
+
+  for (int j = 0; j < cols->num_fields; j++) {
+    if (cols->Sclass[j] == INTSXP || cols->Sclass[j] == REALSXP)
+      continue;
+
+    SEXP col = VECTOR_ELT(output, j);
+    for (int i = 0; i < cols->num_rows; i++) {
+      const char* value = cols->chars[j][i];
+      if (!value) {
+        SET_STRING_ELT(col, i, NA_STRING);
+        continue;
+      }
+      SET_STRING_ELT(col, i, rmysql_mkchar(value, cols->lengths[j][i],
+        cols->encoding[j], &finish->truncated));
+    }
+  }
+
+  if (cols->num_rows < cols->capacity) {
+    for (int j = 0; j < cols->num_fields; j++) {
+      SEXP col = VECTOR_ELT(output, j);
+      PROTECT(SET_LENGTH(col, cols->num_rows));
+      SET_VECTOR_ELT(output, j, col);
+      UNPROTECT(1);
+    }
+  }
+  return R_NilValue;
+}
+
+// cols is freed, whether or not making the strings succeeds
+void rmysql_columns_finish(RMySQLColumns* cols, SEXP output) {
+  RMySQLColumnsFinish finish;
+  finish.cols = cols;
+  finish.output = PROTECT(output);
+  finish.truncated = 0;
+  R_ExecWithCleanup(rmysql_columns_strings, &finish,
+    rmysql_columns_finish_cleanup, &finish);
+  UNPROTECT(1);
+
+  if (finish.truncated)
+    warning("%d strings truncated at embedded nul", finish.truncated);
+}
@@ -6,6 +6,17 @@ MySQLDriver* rmysql_driver() {
   return dbManager;
 }
 
+// Guards the connection table and counters of dbManager
+static pthread_mutex_t rmysql_driver_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void rmysql_driver_lock(void) {
+  pthread_mutex_lock(&rmysql_driver_mutex);
+}
+
+void rmysql_driver_unlock(void) {
+  pthread_mutex_unlock(&rmysql_driver_mutex);
+}
+
 SEXP rmysql_driver_valid() {
   if(!dbManager || !dbManager->connections) {
     return ScalarLogical(FALSE);
@@ -22,3 +22,44 @@ SEXP rmysql_exception_info(SEXP conHandle) {
   UNPROTECT(1);
   return output;
 }
+
+// Server error codes for a statement stopped by its time limit: MySQL's
+// max_execution_time and MariaDB's max_statement_time
+#define RMYSQL_ER_QUERY_TIMEOUT 3024
+#define RMYSQL_ER_STATEMENT_TIMEOUT 1969
+
+int rmysql_is_timeout(unsigned int errnum) {
+  return errnum == RMYSQL_ER_QUERY_TIMEOUT ||
+    errnum == RMYSQL_ER_STATEMENT_TIMEOUT;
+}
+
+/* Raise the error "context: msg". Statements that ran out of time are
+ * signalled with class mysql_timeout, so that callers can tell them apart
+ * from other failures with tryCatch(mysql_timeout = ...).
+ */
+void rmysql_error(unsigned int errnum, const char* context, const char* msg) {
+  if (!rmysql_is_timeout(errnum))
+    error("%s: %s", context, msg);
+
+  char buffer[MYSQL_ERRMSG_SIZE + 128];
+  snprintf(buffer, sizeof(buffer), "%s: %s", context, msg);
+
+  SEXP cond = PROTECT(allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(cond, 0, mkString(buffer));
+  SET_VECTOR_ELT(cond, 1, R_NilValue);
+
+  SEXP names = PROTECT(allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, mkChar("message"));
+  SET_STRING_ELT(names, 1, mkChar("call"));
+  setAttrib(cond, R_NamesSymbol, names);
+
+  SEXP klass = PROTECT(allocVector(STRSXP, 3));
+  SET_STRING_ELT(klass, 0, mkChar("mysql_timeout"));
+  SET_STRING_ELT(klass, 1, mkChar("error"));
+  SET_STRING_ELT(klass, 2, mkChar("condition"));
+  setAttrib(cond, R_ClassSymbol, klass);
+
+  SEXP call = PROTECT(lang2(install("stop"), cond));
+  eval(call, R_BaseEnv);
+  UNPROTECT(4);
+}
@@ -16,15 +16,17 @@ void rmysql_fields_free(RMySQLFields* flds) {
   if(flds->nullOk) free(flds->nullOk);
   if(flds->isVarLength) free(flds->isVarLength);
   if(flds->Sclass) free(flds->Sclass);
+  if(flds->encoding) free(flds->encoding);
   free(flds);
   flds = NULL;
   return;
 }
 
-RMySQLFields* RS_MySQL_createDataMappings(SEXP rsHandle) {
+/* encoding is that of the connection's character set, which is what
+ * the server converts text to. Binary columns are left untagged.
+ */
+RMySQLFields* RS_MySQL_createDataMappings(MYSQL_RES* my_result, cetype_t encoding) {
   // Fetch MySQL field descriptions
-  RS_DBI_resultSet* result = RS_DBI_getResultSet(rsHandle);
-  MYSQL_RES* my_result = result->drvResultSet;
   MYSQL_FIELD* select_dp = mysql_fetch_fields(my_result);
   int num_fields = mysql_num_fields(my_result);
 
@@ -43,6 +45,7 @@ RMySQLFields* RS_MySQL_createDataMappings(SEXP rsHandle) {
   flds->nullOk =      calloc(num_fields, sizeof(int));
   flds->isVarLength = calloc(num_fields, sizeof(int));
   flds->Sclass =      calloc(num_fields, sizeof(SEXPTYPE));
+  flds->encoding =    calloc(num_fields, sizeof(cetype_t));
 
   /* WARNING: TEXT fields are represented as BLOBS (sic),
    * not VARCHAR or some kind of string type. More troublesome is the
@@ -70,6 +73,8 @@ RMySQLFields* RS_MySQL_createDataMappings(SEXP rsHandle) {
     flds->precision[j] = select_dp[j].length;
     flds->scale[j] = select_dp[j].decimals;
     flds->nullOk[j] = (!IS_NOT_NULL(select_dp[j].flags));
+    // 63 is the binary character set
+    flds->encoding[j] = select_dp[j].charsetnr == 63 ? CE_NATIVE : encoding;
 
     int internal_type = select_dp[j].type;
     switch(internal_type) {
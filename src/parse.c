@@ -0,0 +1,248 @@
+#include "parse.h"
+#include <float.h>
+#include <locale.h>
+
+/* Parsing the doubles the server sends as text (FLOAT, DOUBLE, DECIMAL and
+ * integers too large for an int), correctly rounded and regardless of
+ * LC_NUMERIC.
+ *
+ * Values with at most 19 significant digits are converted with the
+ * Eisel-Lemire algorithm: the digits are multiplied by a truncated 128-bit
+ * power of five (src/pow5.c) and the product almost always determines the
+ * nearest double. When it can't, or there are more digits, the value goes
+ * to strtod() with the decimal point swapped for the locale's.
+ *
+ * See Lemire, "Number Parsing at a Gigabyte per Second" (2021).
+ *
+ * Only standard C: no calls into R, so this may run on any thread.
+ */
+
+extern const int rmysql_pow5_smallest;
+extern const int rmysql_pow5_largest;
+extern const uint64_t rmysql_pow5_128[];
+
+static const double rmysql_exact_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int rmysql_leading_zeros(uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_clzll(x);
+#else
+  int n = 0;
+  while (!(x & 0x8000000000000000ULL)) {
+    x <<= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+// Full 128-bit product of a and b
+static void rmysql_mul128(uint64_t a, uint64_t b, uint64_t* high, uint64_t* low) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 product = (unsigned __int128) a * b;
+  *high = (uint64_t) (product >> 64);
+  *low = (uint64_t) product;
+#else
+  uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+  uint64_t lo_lo = a_lo * b_lo;
+  uint64_t hi_lo = a_hi * b_lo;
+  uint64_t lo_hi = a_lo * b_hi;
+  uint64_t hi_hi = a_hi * b_hi;
+  uint64_t cross = (lo_lo >> 32) + (uint32_t) hi_lo + lo_hi;
+  *high = hi_hi + (hi_lo >> 32) + (cross >> 32);
+  *low = (cross << 32) | (uint32_t) lo_lo;
+#endif
+}
+
+/* The double nearest to w * 10^q (w > 0). Returns non-zero if that can't
+ * be decided from the 128-bit approximation of 10^q.
+ */
+static int rmysql_eisel_lemire(uint64_t w, int q, int negative, double* value) {
+  uint64_t bits, mantissa, high, low;
+  int power2;
+
+  if (q < rmysql_pow5_smallest) {
+    bits = 0;
+  } else if (q > rmysql_pow5_largest) {
+    bits = 0x7FFULL << 52;
+  } else {
+    const uint64_t* pow5 = rmysql_pow5_128 + 2 * (q - rmysql_pow5_smallest);
+    int lz = rmysql_leading_zeros(w);
+    w <<= lz;
+
+    // 55 bits of w * 5^q are needed; the second word only matters when
+    // the first product leaves them undecided
+    rmysql_mul128(w, pow5[0], &high, &low);
+    if ((high & 0x1FF) == 0x1FF) {
+      uint64_t high2, low2;
+      rmysql_mul128(w, pow5[1], &high2, &low2);
+      low += high2;
+      if (high2 > low)
+        high++;
+      if (low == 0xFFFFFFFFFFFFFFFFULL && (q < -27 || q > 55))
+        return 1;
+    }
+
+    int upperbit = (int) (high >> 63);
+    int shift = upperbit + 9;
+    mantissa = high >> shift;
+    // binary exponent of 10^q is floor(q * log2(10)), plus the bias
+    power2 = (int) (((152170 + 65536) * (int64_t) q) >> 16) + 63 +
+      upperbit - lz + 1023;
+
+    if (power2 <= 0) {
+      // subnormal
+      if (-power2 + 1 >= 64) {
+        mantissa = 0;
+        power2 = 0;
+      } else {
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        power2 = mantissa < (1ULL << 52) ? 0 : 1;
+      }
+    } else {
+      // exactly halfway between two doubles: round to even
+      if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+          (mantissa << shift) == high)
+        mantissa &= ~1ULL;
+
+      mantissa += mantissa & 1;
+      mantissa >>= 1;
+      if (mantissa >= (2ULL << 52)) {
+        mantissa = 1ULL << 52;
+        power2++;
+      }
+      mantissa &= ~(1ULL << 52);
+      if (power2 >= 0x7FF) {
+        mantissa = 0;
+        power2 = 0x7FF;
+      }
+    }
+    bits = mantissa | ((uint64_t) power2 << 52);
+  }
+
+  if (negative)
+    bits |= 1ULL << 63;
+  memcpy(value, &bits, sizeof(double));
+  return 0;
+}
+
+/* Parse the decimal str[0..len) into *value. Returns non-zero if it isn't
+ * a plain decimal or has more than 19 significant digits.
+ */
+int rmysql_parse_double(const char* str, size_t len, double* value) {
+  const char* p = str;
+  const char* end = str + len;
+  int negative = 0, seen = 0, digits = 0;
+  uint64_t w = 0;
+  long q = 0;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    seen = 1;
+    if (digits == 0 && *p == '0')
+      continue;
+    if (++digits > 19)
+      return 1;
+    w = w * 10 + (*p - '0');
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      seen = 1;
+      q--;
+      if (digits == 0 && *p == '0')
+        continue;
+      if (++digits > 19)
+        return 1;
+      w = w * 10 + (*p - '0');
+    }
+  }
+  if (!seen)
+    return 1;
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    int exp_negative = 0;
+    long exponent = 0;
+
+    p++;
+    if (p < end && (*p == '-' || *p == '+')) {
+      exp_negative = *p == '-';
+      p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+      return 1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+      if (exponent < 100000)
+        exponent = exponent * 10 + (*p - '0');
+    }
+    q += exp_negative ? -exponent : exponent;
+  }
+  if (p != end)
+    return 1;
+
+  if (w == 0) {
+    *value = negative ? -0.0 : 0.0;
+    return 0;
+  }
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+  // Both w and 10^|q| are exact doubles, so one operation rounds correctly
+  if (w <= (1ULL << 53) && q >= -22 && q <= 22) {
+    double d = (double) w;
+    d = q < 0 ? d / rmysql_exact_pow10[-q] : d * rmysql_exact_pow10[q];
+    *value = negative ? -d : d;
+    return 0;
+  }
+#endif
+
+  if (q < -100000 || q > 100000)
+    q = q < 0 ? -100000 : 100000;
+  return rmysql_eisel_lemire(w, (int) q, negative, value);
+}
+
+// strtod() on a copy of str[0..len) using the locale's decimal point
+static double rmysql_strtod(const char* str, size_t len) {
+  const char* point = localeconv()->decimal_point;
+  size_t point_len = strlen(point);
+  char small[64];
+  char* buffer = small;
+  size_t size = len * (point_len > 1 ? point_len : 1) + 1;
+
+  if (size > sizeof(small)) {
+    buffer = malloc(size);
+    if (!buffer)
+      return atof(str);
+  }
+
+  char* out = buffer;
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] == '.') {
+      memcpy(out, point, point_len);
+      out += point_len;
+    } else {
+      *out++ = str[i];
+    }
+  }
+  *out = '\0';
+
+  double value = strtod(buffer, NULL);
+  if (buffer != small)
+    free(buffer);
+  return value;
+}
+
+double rmysql_atof(const char* str, size_t len) {
+  double value;
+  if (rmysql_parse_double(str, len, &value))
+    value = rmysql_strtod(str, len);
+  return value;
+}
@@ -0,0 +1,132 @@
+#ifndef _RMYSQL_PARSE_H
+#define _RMYSQL_PARSE_H 1
+
+// Parsing the numbers the server sends as text. These are plain ASCII: an
+// optional '-' followed by digits, and the client library tells us their
+// length. That lets us check and convert eight digits at once inside a
+// 64-bit register (SWAR), instead of going through atol() one locale-aware
+// character at a time. Anything unusual is left to the C library.
+//
+// Only standard C: this header and parse.c are also used by bench/.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+  defined(_WIN32)
+# define RMYSQL_SWAR 1
+#endif
+
+static const uint64_t rmysql_pow10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL
+};
+
+#ifdef RMYSQL_SWAR
+// Load len (<= 8) digits, right-aligned behind leading '0's. Never reads
+// past the end of the value.
+static inline uint64_t rmysql_load8(const char* digits, size_t len) {
+  char buffer[8];
+  uint64_t chunk;
+
+  memset(buffer, '0', 8);
+  memcpy(buffer + 8 - len, digits, len);
+  memcpy(&chunk, buffer, 8);
+  return chunk;
+}
+
+static inline int rmysql_is_digits8(uint64_t chunk) {
+  return ((chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+    (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+    0x3333333333333333ULL;
+}
+
+// Value of eight ASCII digits, first digit in the lowest byte
+static inline uint32_t rmysql_digits8(uint64_t chunk) {
+  chunk -= 0x3030303030303030ULL;
+  chunk = (chunk * 10) + (chunk >> 8);
+  chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+    (((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  return (uint32_t) chunk;
+}
+#endif
+
+/* Parse len (1 to 19) decimal digits into *value. Returns non-zero if
+ * there is anything else in there.
+ */
+static inline int rmysql_parse_digits(const char* digits, size_t len,
+                                      uint64_t* value) {
+  uint64_t out = 0;
+
+  if (len == 0 || len > 19)
+    return 1;
+
+#ifdef RMYSQL_SWAR
+  while (len >= 8) {
+    uint64_t chunk = rmysql_load8(digits, 8);
+    if (!rmysql_is_digits8(chunk))
+      return 1;
+    out = out * 100000000ULL + rmysql_digits8(chunk);
+    digits += 8;
+    len -= 8;
+  }
+  if (len > 0) {
+    uint64_t chunk = rmysql_load8(digits, len);
+    if (!rmysql_is_digits8(chunk))
+      return 1;
+    out = out * rmysql_pow10[len] + rmysql_digits8(chunk);
+  }
+#else
+  for (size_t i = 0; i < len; i++) {
+    unsigned int digit = (unsigned char) digits[i] - '0';
+    if (digit > 9)
+      return 1;
+    out = out * 10 + digit;
+  }
+#endif
+
+  *value = out;
+  return 0;
+}
+
+/* Parse the integer str[0..len) into *value. Returns non-zero if it isn't
+ * a plain integer or doesn't fit in an int.
+ */
+static inline int rmysql_parse_int(const char* str, size_t len, int* value) {
+  int negative = len > 0 && str[0] == '-';
+  uint64_t magnitude;
+
+  if (negative) {
+    str++;
+    len--;
+  }
+  if (len > 10 || rmysql_parse_digits(str, len, &magnitude))
+    return 1;
+
+  if (negative) {
+    if (magnitude > (uint64_t) INT_MAX + 1)
+      return 1;
+    *value = (int) -(int64_t) magnitude;
+  } else {
+    if (magnitude > INT_MAX)
+      return 1;
+    *value = (int) magnitude;
+  }
+  return 0;
+}
+
+// atol() for the len characters at str, taking the fast path when it can
+static inline int rmysql_atoi(const char* str, size_t len) {
+  int value;
+  if (rmysql_parse_int(str, len, &value))
+    value = (int) atol(str);
+  return value;
+}
+
+// Doubles, see parse.c
+int rmysql_parse_double(const char* str, size_t len, double* value);
+double rmysql_atof(const char* str, size_t len);
+
+#endif // _RMYSQL_PARSE_H
@@ -0,0 +1,290 @@
+#include "RS-MySQL.h"
+
+// Seconds to wait for the lock that aligns the partitions' snapshots
+#define RMYSQL_LOCK_WAIT_S 5
+
+/* Reading a table in parallel, a key range per connection.
+ *
+ * Each statement runs on a connection of its own, opened with the
+ * parameters (and session) of the original one, on a worker thread that
+ * stores its rows. Before that, every connection starts a transaction with
+ * a consistent snapshot while a further connection holds a read lock on
+ * the table, so that all of them see it in the same state. The stored
+ * partitions are then decoded, in order, into a single data frame.
+ */
+
+typedef struct RMySQLPartition {
+  MYSQL *my_connection;
+  const char *statement;
+  int status;                // non-zero if the statement failed
+  MYSQL_RES *my_result;
+  struct RMySQLPartitions *all;
+} RMySQLPartition;
+
+typedef struct RMySQLPartitions {
+  int num_done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} RMySQLPartitions;
+
+static void rmysql_partition_read(RMySQLPartition* part) {
+  part->status = mysql_real_query(part->my_connection, part->statement,
+    (unsigned long) strlen(part->statement));
+  if (!part->status) {
+    part->my_result = mysql_store_result(part->my_connection);
+    if (!part->my_result)
+      part->status = 1;
+  }
+}
+
+static void* rmysql_partition_worker(void* arg) {
+  RMySQLPartition* part = (RMySQLPartition *) arg;
+
+  mysql_thread_init();
+  rmysql_partition_read(part);
+  mysql_thread_end();
+
+  pthread_mutex_lock(&part->all->lock);
+  part->all->num_done++;
+  pthread_cond_signal(&part->all->cond);
+  pthread_mutex_unlock(&part->all->lock);
+  return NULL;
+}
+
+static void rmysql_partitions_close(RMySQLPartition* parts, int n) {
+  for (int k = 0; k < n; k++) {
+    if (parts[k].my_result)
+      mysql_free_result(parts[k].my_result);
+    if (parts[k].my_connection)
+      mysql_close(parts[k].my_connection);
+  }
+  free(parts);
+}
+
+typedef struct RMySQLLock {
+  MYSQL *my_connection;
+  const char *statement;
+  int status;
+} RMySQLLock;
+
+static void rmysql_lock_run(void* data) {
+  RMySQLLock* lock = (RMySQLLock *) data;
+  lock->status = mysql_query(lock->my_connection, lock->statement);
+}
+
+/* Decoding the stored partitions, run with R_ExecWithCleanup so that the
+ * connections are let go of even if allocating the columns fails or the
+ * read is interrupted.
+ */
+typedef struct RMySQLPartitionsDecode {
+  RMySQLPartition *parts;
+  int n;
+  int num_rows;
+  RS_MySQL_conParams *conParams;
+} RMySQLPartitionsDecode;
+
+static void rmysql_partitions_cleanup(void* data) {
+  RMySQLPartitionsDecode* decode = (RMySQLPartitionsDecode *) data;
+  rmysql_partitions_close(decode->parts, decode->n);
+}
+
+static SEXP rmysql_partitions_decode(void* data) {
+  RMySQLPartitionsDecode* decode = (RMySQLPartitionsDecode *) data;
+  RMySQLPartition* parts = decode->parts;
+
+  SEXP output = PROTECT(NEW_LIST(mysql_num_fields(parts[0].my_result)));
+  RMySQLFields* flds = RS_MySQL_createDataMappings(parts[0].my_result,
+    RS_MySQL_encoding(decode->conParams));
+  RMySQLColumns* cols = rmysql_columns_alloc(output, flds, decode->num_rows);
+
+  int interrupted = 0;
+  for (int k = 0; k < decode->n && !interrupted; k++) {
+    MYSQL_RES* my_result = parts[k].my_result;
+    if (decode->conParams->threads > 1)
+      rmysql_columns_decode_parallel(cols, my_result, decode->conParams->threads);
+    while (rmysql_columns_decode(cols, my_result, RMYSQL_CHECK_ROWS) == RMYSQL_CHECK_ROWS) {
+      if (RS_DBI_interrupted()) {
+        interrupted = 1;
+        break;
+      }
+    }
+  }
+  // The strings still point into the stored partitions
+  rmysql_columns_finish(cols, output);
+  if (interrupted)
+    error("query interrupted");
+
+  UNPROTECT(1);
+  return output;
+}
+
+static MYSQL* rmysql_clone(RS_MySQL_conParams* conParams) {
+  MYSQL* my_connection = mysql_init(NULL);
+  if (!my_connection)
+    return NULL;
+  if (RS_MySQL_connect(my_connection, conParams) ||
+      RS_MySQL_replaySession(my_connection, conParams)) {
+    mysql_close(my_connection);
+    return NULL;
+  }
+  return my_connection;
+}
+
+/* Run each of statements on its own connection, in parallel, and return
+ * their rows as one data frame, in the order of statements. If lock (a
+ * LOCK TABLES statement) is given, it is held while the connections take
+ * their snapshots; failing to take it only warns.
+ */
+SEXP RS_MySQL_readPartitions(SEXP conHandle, SEXP statements, SEXP lock) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  RS_MySQL_conParams* conParams = con->conParams;
+  int n = length(statements);
+
+  RMySQLPartition* parts = calloc(n, sizeof(RMySQLPartition));
+  if (!parts)
+    error("Could not allocate memory for partitions");
+
+  for (int k = 0; k < n; k++) {
+    parts[k].statement = RS_MySQL_text(conParams, STRING_ELT(statements, k));
+    parts[k].my_connection = rmysql_clone(conParams);
+    if (!parts[k].my_connection) {
+      rmysql_partitions_close(parts, n);
+      error("could not open a connection for partition %d", k + 1);
+    }
+  }
+
+  /* Writes in progress (even on con itself) would hold up the lock for as
+   * long as lock_wait_timeout, a year by default, so it's only waited for
+   * briefly, and on a thread so that it can be interrupted.
+   */
+  MYSQL* lock_connection = NULL;
+  int locked = 1;
+  if (lock != R_NilValue) {
+    RMySQLLock locking;
+    locking.my_connection = lock_connection = rmysql_clone(conParams);
+    locking.statement = RS_MySQL_text(conParams, STRING_ELT(lock, 0));
+    locking.status = 1;
+
+    if (lock_connection) {
+      char sql[64];
+      snprintf(sql, sizeof(sql), "SET SESSION lock_wait_timeout = %d",
+        RMYSQL_LOCK_WAIT_S);
+      if (!mysql_query(lock_connection, sql) &&
+          RS_MySQL_runThreadOn(con, lock_connection, rmysql_lock_run, &locking)) {
+        mysql_close(lock_connection);
+        rmysql_partitions_close(parts, n);
+        error("query interrupted");
+      }
+    }
+    if (locking.status) {
+      // Only warned about once the connections are let go of
+      locked = 0;
+      if (lock_connection)
+        mysql_close(lock_connection);
+      lock_connection = NULL;
+    }
+  }
+
+  for (int k = 0; k < n; k++) {
+    if (mysql_query(parts[k].my_connection, "START TRANSACTION WITH CONSISTENT SNAPSHOT")) {
+      char msg[MYSQL_ERRMSG_SIZE];
+      strncpy(msg, mysql_error(parts[k].my_connection), MYSQL_ERRMSG_SIZE - 1);
+      msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+      if (lock_connection)
+        mysql_close(lock_connection);
+      rmysql_partitions_close(parts, n);
+      error("could not start transaction: %s", msg);
+    }
+  }
+  if (lock_connection) {
+    mysql_query(lock_connection, "UNLOCK TABLES");
+    mysql_close(lock_connection);
+  }
+
+  RMySQLPartitions all;
+  all.num_done = 0;
+  pthread_mutex_init(&all.lock, NULL);
+  pthread_cond_init(&all.cond, NULL);
+
+  pthread_t* threads = (pthread_t *) R_alloc(n, sizeof(pthread_t));
+  int* started = (int *) R_alloc(n, sizeof(int));
+  int num_started = 0;
+  for (int k = 0; k < n; k++) {
+    parts[k].all = &all;
+    started[k] = pthread_create(&threads[k], NULL, rmysql_partition_worker, &parts[k]) == 0;
+    if (!started[k]) {
+      // Read this one once the others are done
+      parts[k].status = -1;
+      continue;
+    }
+    num_started++;
+  }
+
+  int killed = 0;
+  pthread_mutex_lock(&all.lock);
+  while (all.num_done < num_started) {
+    struct timespec deadline;
+    rmysql_deadline(&deadline, RMYSQL_POLL_MS);
+    pthread_cond_timedwait(&all.cond, &all.lock, &deadline);
+
+    if (all.num_done < num_started && !killed) {
+      pthread_mutex_unlock(&all.lock);
+      if (RS_DBI_interrupted()) {
+        for (int k = 0; k < n; k++) {
+          if (started[k])
+            RS_MySQL_killThread(conParams, mysql_thread_id(parts[k].my_connection));
+        }
+        killed = 1;
+      }
+      pthread_mutex_lock(&all.lock);
+    }
+  }
+  pthread_mutex_unlock(&all.lock);
+
+  for (int k = 0; k < n; k++) {
+    if (started[k]) {
+      pthread_join(threads[k], NULL);
+    } else if (!killed) {
+      // On the R thread, whose client library state mustn't be torn down
+      rmysql_partition_read(&parts[k]);
+    }
+  }
+  pthread_mutex_destroy(&all.lock);
+  pthread_cond_destroy(&all.cond);
+
+  if (killed) {
+    rmysql_partitions_close(parts, n);
+    error("query interrupted");
+  }
+
+  double num_rows = 0;
+  for (int k = 0; k < n; k++) {
+    if (parts[k].status) {
+      char msg[MYSQL_ERRMSG_SIZE];
+      strncpy(msg, mysql_error(parts[k].my_connection), MYSQL_ERRMSG_SIZE - 1);
+      msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+      unsigned int errnum = mysql_errno(parts[k].my_connection);
+      rmysql_partitions_close(parts, n);
+      rmysql_error(errnum, "could not read partition", msg);
+    }
+    num_rows += (double) mysql_num_rows(parts[k].my_result);
+  }
+  if (num_rows > INT_MAX) {
+    rmysql_partitions_close(parts, n);
+    error("too many rows for a data frame: %.0f", num_rows);
+  }
+
+  RMySQLPartitionsDecode decode;
+  decode.parts = parts;
+  decode.n = n;
+  decode.num_rows = (int) num_rows;
+  decode.conParams = conParams;
+  SEXP output = PROTECT(R_ExecWithCleanup(rmysql_partitions_decode, &decode,
+    rmysql_partitions_cleanup, &decode));
+
+  if (!locked)
+    warning("could not lock the table, partitions may be read from different snapshots");
+  make_data_frame(output);
+  UNPROTECT(1);
+  return output;
+}
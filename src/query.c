@@ -0,0 +1,322 @@
+#include "RS-MySQL.h"
+#include <pthread.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <strings.h>
+#include <errmsg.h>
+
+/* Running statements so that they can be interrupted.
+ *
+ * mysql_real_query() blocks until the server has finished executing the
+ * statement, which leaves no chance to react to Ctrl-C. On interruptible
+ * connections the statement runs on a worker thread instead, while the R
+ * thread waits for it and polls for user interrupts. On an interrupt the
+ * statement is killed on the server (see RS_MySQL_killQuery), the worker
+ * returns with an error and the connection is ready for the next statement.
+ */
+
+typedef struct RMySQLTask {
+  void (*work)(void*);
+  void *data;
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} RMySQLTask;
+
+static void* rmysql_task_worker(void* arg) {
+  RMySQLTask* task = (RMySQLTask *) arg;
+
+  mysql_thread_init();
+  task->work(task->data);
+  mysql_thread_end();
+
+  pthread_mutex_lock(&task->lock);
+  task->done = 1;
+  pthread_cond_signal(&task->cond);
+  pthread_mutex_unlock(&task->lock);
+  return NULL;
+}
+
+void rmysql_deadline(struct timespec* ts, int ms) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  long nsec = now.tv_usec * 1000L + (ms % 1000) * 1000000L;
+  ts->tv_sec = now.tv_sec + ms / 1000 + nsec / 1000000000L;
+  ts->tv_nsec = nsec % 1000000000L;
+}
+
+/* Run work(data) on a worker thread while the R thread waits and polls
+ * for interrupts. work must not call into R. On an interrupt the statement
+ * running on con is killed on the server, which makes work return early.
+ * Returns non-zero if the user interrupted.
+ */
+int RS_MySQL_runThread(RS_DBI_connection* con, void (*work)(void*), void* data) {
+  return RS_MySQL_runThreadOn(con, (MYSQL *) con->drvConnection, work, data);
+}
+
+/* Ditto, for work running a statement on my_connection, another connection
+ * opened with con's parameters (e.g. a clone), which is what gets killed.
+ */
+int RS_MySQL_runThreadOn(RS_DBI_connection* con, MYSQL* my_connection,
+                         void (*work)(void*), void* data) {
+  RMySQLTask task;
+  task.work = work;
+  task.data = data;
+  task.done = 0;
+
+  pthread_t worker;
+  pthread_mutex_init(&task.lock, NULL);
+  pthread_cond_init(&task.cond, NULL);
+  if (pthread_create(&worker, NULL, rmysql_task_worker, &task)) {
+    pthread_mutex_destroy(&task.lock);
+    pthread_cond_destroy(&task.cond);
+    error("could not start query thread");
+  }
+
+  // Once interrupted, the kill is sent again (backing off) until the
+  // statement ends: it may fail, or land before the statement started
+  int killed = 0;
+  int wait = 0, backoff = RMYSQL_POLL_MS;
+  pthread_mutex_lock(&task.lock);
+  while (!task.done) {
+    struct timespec deadline;
+    rmysql_deadline(&deadline, RMYSQL_POLL_MS);
+    pthread_cond_timedwait(&task.cond, &task.lock, &deadline);
+
+    if (!task.done) {
+      pthread_mutex_unlock(&task.lock);
+      int pressed = RS_DBI_interrupted();
+      wait -= RMYSQL_POLL_MS;
+      if (pressed || (killed && wait <= 0)) {
+        RS_MySQL_killThread(con->conParams, mysql_thread_id(my_connection));
+        killed = 1;
+        wait = backoff;
+        if (backoff < RMYSQL_KILL_MAX_WAIT_MS)
+          backoff *= 2;
+      }
+      pthread_mutex_lock(&task.lock);
+    }
+  }
+  pthread_mutex_unlock(&task.lock);
+
+  pthread_join(worker, NULL);
+  pthread_mutex_destroy(&task.lock);
+  pthread_cond_destroy(&task.cond);
+
+  return killed;
+}
+
+typedef struct RMySQLQuery {
+  MYSQL *my_connection;
+  const char *statement;
+  int buffered;          // store (rather than use) the result
+  int status;            // mysql_real_query() return value
+  MYSQL_RES *my_result;
+} RMySQLQuery;
+
+static void rmysql_query_run(void* data) {
+  RMySQLQuery* query = (RMySQLQuery *) data;
+
+  query->status = mysql_real_query(query->my_connection, query->statement,
+    (unsigned long) strlen(query->statement));
+  if (!query->status) {
+    query->my_result = query->buffered ?
+      mysql_store_result(query->my_connection) :
+      mysql_use_result(query->my_connection);
+  }
+}
+
+static int rmysql_query_once(RS_DBI_connection* con, const char* statement,
+                             int buffered, MYSQL_RES** my_result) {
+  RS_MySQL_conParams* conParams = (RS_MySQL_conParams *) con->conParams;
+  RMySQLQuery query;
+
+  query.my_connection = (MYSQL *) con->drvConnection;
+  query.statement = statement;
+  query.buffered = buffered;
+  query.status = 0;
+  query.my_result = NULL;
+
+  if (!conParams->interruptible) {
+    rmysql_query_run(&query);
+    *my_result = query.my_result;
+    return query.status;
+  }
+
+  // The kill may land after the statement completed: then it's done (and
+  // may have changed data), so it's reported as such, not as interrupted.
+  // Only a statement that failed, or whose rows couldn't be read, was.
+  if (RS_MySQL_runThread(con, rmysql_query_run, &query) &&
+      (query.status || (!query.my_result && mysql_field_count(query.my_connection)))) {
+    *my_result = NULL;
+    return RMYSQL_INTERRUPTED;
+  }
+
+  *my_result = query.my_result;
+  return query.status;
+}
+
+typedef struct RMySQLNext {
+  MYSQL *my_connection;
+  int status;            // mysql_next_result() return value
+  MYSQL_RES *my_result;
+} RMySQLNext;
+
+static void rmysql_next_run(void* data) {
+  RMySQLNext* next = (RMySQLNext *) data;
+
+  next->status = mysql_next_result(next->my_connection);
+  if (next->status == 0)
+    next->my_result = mysql_store_result(next->my_connection);
+}
+
+/* Move on to the next result of a batch of statements, as
+ * mysql_next_result() does (0 with the stored result in *my_result, -1
+ * when there are no more, > 0 on error), which may have to wait for the
+ * next statement to run. So on interruptible connections it waits on a
+ * worker thread, and returns RMYSQL_INTERRUPTED if the user interrupted.
+ */
+int RS_MySQL_nextResult(RS_DBI_connection* con, MYSQL_RES** my_result) {
+  RS_MySQL_conParams* conParams = (RS_MySQL_conParams *) con->conParams;
+  RMySQLNext next;
+
+  next.my_connection = (MYSQL *) con->drvConnection;
+  next.status = 0;
+  next.my_result = NULL;
+
+  if (!conParams->interruptible) {
+    rmysql_next_run(&next);
+  } else if (RS_MySQL_runThread(con, rmysql_next_run, &next) && next.status > 0) {
+    // as in rmysql_query_once, only a statement the kill stopped counts
+    *my_result = NULL;
+    return RMYSQL_INTERRUPTED;
+  }
+
+  *my_result = next.my_result;
+  return next.status;
+}
+
+// Did the client lose its connection to the server?
+static int rmysql_is_disconnect(unsigned int errnum) {
+  return errnum == CR_SERVER_GONE_ERROR || errnum == CR_SERVER_LOST;
+}
+
+/* Can statement safely run again after the connection dropped halfway
+ * through it? Only single read-only statements qualify.
+ */
+static int rmysql_is_retryable(const char* statement) {
+  static const char* reads[] = {"SELECT", "SHOW", "DESCRIBE", "DESC", "EXPLAIN"};
+
+  if (strchr(statement, ';'))
+    return 0;
+
+  while (isspace((unsigned char) *statement))
+    statement++;
+  for (size_t i = 0; i < sizeof(reads) / sizeof(reads[0]); i++) {
+    size_t n = strlen(reads[i]);
+    if (!strncasecmp(statement, reads[i], n) && isspace((unsigned char) statement[n]))
+      return 1;
+  }
+  return 0;
+}
+
+/* If the last statement on con lost the server, and con was opened with
+ * reconnect, connect again. A failure is left for the next statement to
+ * report.
+ */
+void RS_MySQL_revive(RS_DBI_connection* con) {
+  RS_MySQL_conParams* conParams = (RS_MySQL_conParams *) con->conParams;
+
+  if (conParams->reconnect && rmysql_is_disconnect(mysql_errno(con->drvConnection)))
+    RS_MySQL_reconnect(con);
+}
+
+/* Connect con again if its last statement lost the server (or it no longer
+ * answers a ping), whether or not it was opened with reconnect. Returns
+ * TRUE if it did, so that the caller may retry the statement.
+ */
+SEXP rmysql_connection_revive(SEXP conHandle) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  MYSQL* my_connection = (MYSQL *) con->drvConnection;
+
+  if (!rmysql_is_disconnect(mysql_errno(my_connection)) && !mysql_ping(my_connection))
+    return ScalarLogical(FALSE);
+  return ScalarLogical(RS_MySQL_reconnect(con) == 0);
+}
+
+/* Run statement on con and return its result (NULL if it has none, check
+ * mysql_field_count() to tell it apart from a failed SELECT). Returns
+ * non-zero if the statement failed, with the error left in the connection,
+ * or RMYSQL_INTERRUPTED if the user interrupted it.
+ *
+ * On connections opened with reconnect, losing the server reconnects (see
+ * RS_MySQL_reconnect): straight away to run read-only statements again
+ * (unless a transaction was open), otherwise before the next statement so
+ * that this one's error can still be reported. con->drvConnection changes
+ * when that happens.
+ */
+int RS_MySQL_query(RS_DBI_connection* con, const char* statement,
+                   int buffered, MYSQL_RES** my_result) {
+  RS_MySQL_conParams* conParams = (RS_MySQL_conParams *) con->conParams;
+  int reconnect = conParams->reconnect;
+
+  RS_MySQL_revive(con);
+
+  MYSQL* my_connection = (MYSQL *) con->drvConnection;
+  int in_transaction = my_connection->server_status & SERVER_STATUS_IN_TRANS;
+
+  int status = rmysql_query_once(con, statement, buffered, my_result);
+  if (status == RMYSQL_INTERRUPTED)
+    return status;
+
+  if (status && reconnect && !in_transaction &&
+      rmysql_is_disconnect(mysql_errno(my_connection)) &&
+      rmysql_is_retryable(statement) &&
+      RS_MySQL_reconnect(con) == 0) {
+    status = rmysql_query_once(con, statement, buffered, my_result);
+  }
+
+  rmysql_stmt_cache_check(con, statement);
+  if (!status)
+    RS_MySQL_recordSession(conParams, statement);
+  return status;
+}
+
+/* Rewrite statement so that the server stops it after s_timeout seconds.
+ * MariaDB can limit any statement with SET STATEMENT ... FOR; MySQL only
+ * limits SELECTs, through an optimizer hint (other statements are returned
+ * unchanged). When the limit is hit the statement fails with an error that
+ * rmysql_error signals as a mysql_timeout condition.
+ */
+SEXP RS_MySQL_timeoutStatement(SEXP conHandle, SEXP statement, SEXP s_timeout) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  MYSQL* my_connection = (MYSQL *) con->drvConnection;
+  const char* sql = RS_MySQL_text(con->conParams, STRING_ELT(statement, 0));
+
+  double timeout = asReal(s_timeout);
+  if (ISNAN(timeout) || timeout <= 0)
+    error("timeout must be a positive number of seconds");
+
+  size_t size = strlen(sql) + 96;
+  char* out = R_alloc(size, 1);
+
+  if (strstr(mysql_get_server_info(my_connection), "MariaDB")) {
+    snprintf(out, size, "SET STATEMENT max_statement_time = %.3f FOR %s",
+      timeout, sql);
+    return mkString(out);
+  }
+
+  const char* start = sql;
+  while (isspace((unsigned char) *start))
+    start++;
+  if (strncasecmp(start, "SELECT", 6) || !isspace((unsigned char) start[6]))
+    return statement;
+
+  unsigned long ms = (unsigned long) (timeout * 1000);
+  if (ms == 0)
+    ms = 1;
+  snprintf(out, size, "%.*s /*+ MAX_EXECUTION_TIME(%lu) */%s",
+    (int) (start - sql + 6), sql, ms, start + 6);
+  return mkString(out);
+}
@@ -1,4 +1,9 @@
 #include "RS-MySQL.h"
+#include "parse.h"
+
+// Bytes of unread rows closeResultSet drains before it kills the query
+// (which takes a connection of its own, so isn't worth it for less)
+#define RMYSQL_ABORT_BYTES (1 << 20)
 
 SEXP RS_DBI_allocResultSet(SEXP conHandle) {
   RS_DBI_connection *con = RS_DBI_getConnection(conHandle);
@@ -24,6 +29,8 @@ SEXP RS_DBI_allocResultSet(SEXP conHandle) {
   result->rowCount = (int) 0;
   result->completed = (int) -1;
   result->fields = NULL;
+  result->drvStatement = NULL;
+  result->drvBinds = NULL;
 
   /* update connection's resultSet table */
   int res_id = con->counter;
@@ -42,6 +49,9 @@ void RS_DBI_freeResultSet(SEXP rsHandle) {
   if(result->drvResultSet) {
     error("internal error in RS_DBI_freeResultSet: non-freed result->drvResultSet (some memory leaked)");
   }
+  if(result->drvStatement) {
+    error("internal error in RS_DBI_freeResultSet: non-closed result->drvStatement (some memory leaked)");
+  }
 
   if (result->statement)
     free(result->statement);
@@ -148,12 +158,47 @@ SEXP RS_MySQL_nextResultSet(SEXP conHandle) {
   }
 
   if (is_select)
-    result->fields = RS_MySQL_createDataMappings(rsHandle);
+    result->fields = RS_MySQL_createDataMappings(result->drvResultSet,
+      RS_MySQL_encoding(con->conParams));
 
   return rsHandle;
 }
 
 
+/* MySQL only allows one result set per connection to stream rows over
+ * the text protocol. Results read through a server-side cursor live on the
+ * server and don't tie up the connection, so they are skipped here.
+ */
+RS_DBI_resultSet* RS_MySQL_pendingResult(RS_DBI_connection* con) {
+  for (int i = 0; i < con->length; i++) {
+    RS_DBI_resultSet* result = con->resultSets[i];
+    if (con->resultSetIds[i] < 0 || !result)
+      continue;
+    if (!result->drvStatement)
+      return result;
+  }
+  return NULL;
+}
+
+/* Do we have a pending resultSet in the current connection? Errors if it
+ * still has rows to read, otherwise closes it to make room for the next
+ * statement.
+ */
+void RS_MySQL_closePending(SEXP conHandle) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  RS_DBI_resultSet* result = RS_MySQL_pendingResult(con);
+  if (!result)
+    return;
+
+  if (result->completed == 0)
+    error("connection with pending rows, close resultSet before continuing");
+
+  RS_MySQL_closeResultSet(
+    RS_DBI_asResHandle(MGR_ID(conHandle), CON_ID(conHandle), result->resultSetId)
+  );
+}
+
+
 /* Execute (currently) one sql statement (INSERT, DELETE, SELECT, etc.),
 * set coercion type mappings between the server internal data types and
 * S classes.   Returns  an S handle to a resultSet object.
@@ -165,46 +210,35 @@ SEXP RS_MySQL_exec(SEXP conHandle, SEXP statement) {
   MYSQL             *my_connection;
   MYSQL_RES         *my_result;
   int      num_fields, state;
-  int     res_id, is_select;
+  int     is_select;
   char     *dyn_statement;
 
   con = RS_DBI_getConnection(conHandle);
   my_connection = (MYSQL *) con->drvConnection;
-  dyn_statement = RS_DBI_copyString(CHR_EL(statement,0));
 
-  /* Do we have a pending resultSet in the current connection?
-   * MySQL only allows  one resultSet per connection.
+  RS_MySQL_closePending(conHandle);
+  dyn_statement = RS_DBI_copyString(RS_MySQL_text(con->conParams, STRING_ELT(statement,0)));
+
+  /* Here is where we actually run the query. Do we need output
+   * column/field descriptors?  Only for SELECT-like statements. The MySQL
+   * reference manual suggests invoking mysql_use_result() and if it
+   * succeed the statement is SELECT-like that can use a resultSet.
+   * Otherwise call mysql_field_count() and if it returns zero, the sql was
+   * not a SELECT-like statement. Finally a non-zero means a failed
+   * SELECT-like statement.
    */
-  if(con->num_res>0){
-    res_id = (int) con->resultSetIds[0]; /* recall, MySQL has only 1 res */
-  rsHandle = RS_DBI_asResHandle(MGR_ID(conHandle),
-    CON_ID(conHandle), res_id);
-  result = RS_DBI_getResultSet(rsHandle);
-  if(result->completed == 0){
+  state = RS_MySQL_query(con, dyn_statement, 0, &my_result);
+  my_connection = (MYSQL *) con->drvConnection;
+  if(state == RMYSQL_INTERRUPTED) {
     free(dyn_statement);
-    error("connection with pending rows, close resultSet before continuing");
+    error("query interrupted");
   }
-  else
-    RS_MySQL_closeResultSet(rsHandle);
-  }
-
-  /* Here is where we actually run the query */
-  state = mysql_query(my_connection, dyn_statement);
   if(state) {
-    error("could not run statement: %s", mysql_error(my_connection));
+    free(dyn_statement);
+    rmysql_error(mysql_errno(my_connection), "could not run statement",
+      mysql_error(my_connection));
   }
 
-  /* Do we need output column/field descriptors?  Only for SELECT-like
-   * statements. The MySQL reference manual suggests invoking
-   * mysql_use_result() and if it succeed the statement is SELECT-like
-   * that can use a resultSet.  Otherwise call mysql_field_count()
-   * and if it returns zero, the sql was not a SELECT-like statement.
-   * Finally a non-zero means a failed SELECT-like statement.
-   */
-  my_result = mysql_use_result(my_connection);
-  if(!my_result)
-    my_result = (MYSQL_RES *) NULL;
-
   num_fields = (int) mysql_field_count(my_connection);
   is_select = (int) TRUE;
   if(!my_result){
@@ -233,65 +267,45 @@ SEXP RS_MySQL_exec(SEXP conHandle, SEXP statement) {
   }
 
   if(is_select)
-    result->fields = RS_MySQL_createDataMappings(rsHandle);
+    result->fields = RS_MySQL_createDataMappings(result->drvResultSet,
+      RS_MySQL_encoding(con->conParams));
 
   free(dyn_statement);
   return rsHandle;
 }
 
 
-// output is a named list
-SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
-  MySQLDriver   *mgr;
-  RS_DBI_resultSet *result;
-  RMySQLFields* flds;
-  MYSQL_RES *my_result;
+/* Fetch up to *num_rec rows (or all of them if expand) from a text-protocol
+ * result into output, which has been allocated by RS_DBI_allocOutput.
+ * Returns the number of rows read.
+ */
+int RS_MySQL_fetchRows(MYSQL* my_connection, MYSQL_RES* my_result,
+                       RMySQLFields* flds, SEXP output, int* num_rec,
+                       int expand, int* completed) {
   MYSQL_ROW  row;
-  SEXP output, s_tmp;
-
   unsigned long  *lens;
-  int    i, j, null_item, expand;
-  int   completed;
-  SEXPTYPE  *fld_Sclass;
-  int   num_rec;
-  int    num_fields;
-
-  result = RS_DBI_getResultSet(rsHandle);
-  flds = result->fields;
-  if(!flds)
-    error("corrupt resultSet, missing fieldDescription");
-  num_rec = asInteger(max_rec);
-  expand = (num_rec < 0);   // dyn expand output to accommodate all rows
-  if(expand || num_rec == 0){
-    mgr = rmysql_driver();
-    num_rec = mgr->fetch_default_rec;
-  }
-  num_fields = flds->num_fields;
-  PROTECT(output = NEW_LIST((int) num_fields));
-  RS_DBI_allocOutput(output, flds, num_rec, 0);
-  fld_Sclass = flds->Sclass;
-
-  // actual fetching....
-  my_result = (MYSQL_RES *) result->drvResultSet;
-  completed = (int) 0;
+  int    i, j, null_item, truncated;
+  SEXPTYPE  *fld_Sclass = flds->Sclass;
+  int    num_fields = flds->num_fields;
 
   for(i = 0; ; i++){
-    if(i==num_rec){  // exhausted the allocated space
+    if(i==*num_rec){  // exhausted the allocated space
 
       if(expand){    // do we extend or return the records fetched so far
-        num_rec = 2 * num_rec;
-        RS_DBI_allocOutput(output, flds, num_rec, expand);
+        *num_rec = 2 * (*num_rec);
+        RS_DBI_allocOutput(output, flds, *num_rec, expand);
       }
       else
         break;       // okay, no more fetching for now
     }
+    if(i > 0 && i % RMYSQL_CHECK_ROWS == 0 && RS_DBI_interrupted()){
+      *completed = RMYSQL_INTERRUPTED;
+      break;
+    }
     row = mysql_fetch_row(my_result);
     if(row==NULL){    // either we finish or we encounter an error
-      unsigned int  err_no;
-      RS_DBI_connection   *con;
-      con = RS_DBI_getConnection(rsHandle);
-      err_no = mysql_errno((MYSQL *) con->drvConnection);
-      completed = (int) (err_no ? -1 : 1);
+      unsigned int err_no = mysql_errno(my_connection);
+      *completed = (int) (err_no ? -1 : 1);
       break;
     }
     lens = mysql_fetch_lengths(my_result);
@@ -306,7 +320,7 @@ SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
         if(null_item)
           NA_SET(&(LST_INT_EL(output,j,i)), INTSXP);
         else
-          LST_INT_EL(output,j,i) = (int) atol(row[j]);
+          LST_INT_EL(output,j,i) = rmysql_atoi(row[j], lens[j]);
         break;
 
       case STRSXP:
@@ -317,10 +331,11 @@ SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
         if(null_item)
           SET_LST_CHR_EL(output,j,i,NA_STRING);
         else {
-          if((size_t) lens[j] != strlen(row[j])){
-            warning("internal error: row %d field %d truncated", i, j);
-          }
-          SET_LST_CHR_EL(output,j,i,mkChar(row[j]));
+          truncated = 0;
+          SET_LST_CHR_EL(output,j,i,
+            rmysql_mkchar(row[j], lens[j], flds->encoding[j], &truncated));
+          if(truncated)
+            warning("row %d field %d truncated at embedded nul", i, j);
         }
         break;
 
@@ -328,7 +343,7 @@ SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
         if(null_item)
           NA_SET(&(LST_NUM_EL(output,j,i)), REALSXP);
         else
-          LST_NUM_EL(output,j,i) = (double) atof(row[j]);
+          LST_NUM_EL(output,j,i) = rmysql_atof(row[j], lens[j]);
         break;
 
       default:  // error, but we'll try the field as character (!)
@@ -336,26 +351,293 @@ SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
           SET_LST_CHR_EL(output,j,i, NA_STRING);
         else {
           warning("unrecognized field type %d in column %d", fld_Sclass[j], j);
-          SET_LST_CHR_EL(output,j,i,mkChar(row[j]));
+          truncated = 0;
+          SET_LST_CHR_EL(output,j,i,
+            rmysql_mkchar(row[j], lens[j], flds->encoding[j], &truncated));
+          if(truncated)
+            warning("row %d field %d truncated at embedded nul", i, j);
         }
         break;
       }
     }
   }
 
+  return i;
+}
+
+/* Stop a text-protocol result that still has rows coming: kill the query
+ * on the server, then read whatever rows were already in flight so that
+ * the connection can be used again.
+ */
+static void rmysql_abort_rows(RS_DBI_connection* con, MYSQL_RES* my_result) {
+  RS_MySQL_killQuery(con);
+  while(mysql_fetch_row(my_result))
+    ;
+}
+
+/* Same for a batch of statements: stop the one that is running and discard
+ * the results of any that already finished.
+ */
+static void rmysql_abort_batch(RS_DBI_connection* con) {
+  MYSQL* my_connection = (MYSQL *) con->drvConnection;
+
+  RS_MySQL_killQuery(con);
+  while(mysql_more_results(my_connection) && mysql_next_result(my_connection) == 0){
+    MYSQL_RES* my_result = mysql_store_result(my_connection);
+    if(my_result)
+      mysql_free_result(my_result);
+  }
+}
+
+// adjust the length of each of the members in the output list
+static void rmysql_truncate_output(SEXP output, int num_fields, int num_rec) {
+  for(int j = 0; j < num_fields; j++){
+    SEXP s_tmp = LST_EL(output,j);
+    PROTECT(SET_LENGTH(s_tmp, num_rec));
+    SET_ELEMENT(output, j, s_tmp);
+    UNPROTECT(1);
+  }
+}
+
+// Reading a stored result, so that it's freed even if that fails
+typedef struct RMySQLRead {
+  MYSQL_RES *my_result;
+  RS_MySQL_conParams *conParams;
+  int completed;
+} RMySQLRead;
+
+static SEXP rmysql_read_run(void* data) {
+  RMySQLRead* read = (RMySQLRead *) data;
+  return RS_MySQL_readDataFrame(read->my_result, read->conParams, &read->completed);
+}
+
+static void rmysql_read_cleanup(void* data) {
+  mysql_free_result(((RMySQLRead *) data)->my_result);
+}
+
+/* dbGetQuery in one call: run the statement, read all rows into a data
+ * frame and release the result, without registering a result set. Returns
+ * NULL for statements that don't return rows.
+ */
+SEXP RS_MySQL_getQuery(SEXP conHandle, SEXP statement) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  const char* sql = RS_MySQL_text(con->conParams, STRING_ELT(statement, 0));
+
+  RS_MySQL_closePending(conHandle);
+
+  // Storing the result tells us how many rows to allocate up front
+  MYSQL_RES* my_result;
+  int state = RS_MySQL_query(con, sql, 1, &my_result);
+  MYSQL* my_connection = con->drvConnection;
+  if(state == RMYSQL_INTERRUPTED)
+    error("query interrupted");
+  if(state)
+    rmysql_error(mysql_errno(my_connection), "could not run statement",
+      mysql_error(my_connection));
+
+  if(!my_result){
+    if(mysql_field_count(my_connection) > 0)
+      rmysql_error(mysql_errno(my_connection), "error in select/select-like",
+        mysql_error(my_connection));
+    return R_NilValue;
+  }
+
+  RMySQLRead read;
+  read.my_result = my_result;
+  read.conParams = con->conParams;
+  read.completed = 0;
+  SEXP output = PROTECT(R_ExecWithCleanup(rmysql_read_run, &read,
+    rmysql_read_cleanup, &read));
+  if(read.completed == RMYSQL_INTERRUPTED)
+    error("query interrupted");
+
+  UNPROTECT(1);
+  return output;
+}
+
+// A batch being run by RS_MySQL_execMulti
+typedef struct RMySQLBatch {
+  RS_DBI_connection *con;
+  const char *sql;
+  int toggle;                // multi statements were switched on for it
+  MYSQL_RES *my_result;      // the result being read, if any
+} RMySQLBatch;
+
+/* However the batch ended (even by an R error half way through), leave
+ * the connection ready for the next statement: nothing left to read, and
+ * multi statements as they were.
+ */
+static void rmysql_batch_cleanup(void* data) {
+  RMySQLBatch* batch = (RMySQLBatch *) data;
+  MYSQL* my_connection = (MYSQL *) batch->con->drvConnection;
+
+  if(batch->my_result)
+    mysql_free_result(batch->my_result);
+  batch->my_result = NULL;
+  while(mysql_more_results(my_connection) && mysql_next_result(my_connection) == 0){
+    MYSQL_RES* my_result = mysql_store_result(my_connection);
+    if(my_result)
+      mysql_free_result(my_result);
+  }
+  if(batch->toggle)
+    mysql_set_server_option(my_connection, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+}
+
+static SEXP rmysql_batch_run(void* data) {
+  RMySQLBatch* batch = (RMySQLBatch *) data;
+  RS_DBI_connection* con = batch->con;
+  RS_MySQL_conParams* conParams = con->conParams;
+
+  int n = 0, size = 16, status, completed;
+  SEXP output;
+  PROTECT_INDEX ipx;
+  PROTECT_WITH_INDEX(output = allocVector(VECSXP, size), &ipx);
+
+  status = RS_MySQL_query(con, batch->sql, 1, &batch->my_result);
+  // a read retried after losing the server ran on a new handle
+  MYSQL* my_connection = con->drvConnection;
+  while(!status){
+    SEXP value;
+    if(batch->my_result){
+      value = PROTECT(RS_MySQL_readDataFrame(batch->my_result, conParams, &completed));
+      mysql_free_result(batch->my_result);
+      batch->my_result = NULL;
+      if(completed == RMYSQL_INTERRUPTED){
+        UNPROTECT(1);
+        status = RMYSQL_INTERRUPTED;
+        break;
+      }
+    } else if(mysql_field_count(my_connection) == 0){
+      value = PROTECT(ScalarInteger((int) mysql_affected_rows(my_connection)));
+    } else {
+      status = 1;
+      break;
+    }
+
+    if(n == size){
+      size *= 2;
+      REPROTECT(output = lengthgets(output, size), ipx);
+    }
+    SET_VECTOR_ELT(output, n++, value);
+    UNPROTECT(1);
+
+    // 0: more results, -1: no more results, > 0: error
+    status = RS_MySQL_nextResult(con, &batch->my_result);
+    if(status == -1)
+      break;
+  }
+
+  if(status == RMYSQL_INTERRUPTED){
+    rmysql_abort_batch(con);
+    error("query interrupted while running statement %d", n + 1);
+  }
+  if(status > 0)
+    error("could not run statement %d: %s", n + 1, mysql_error(my_connection));
+
+  output = lengthgets(output, n);
+  UNPROTECT(1);
+  return output;
+}
+
+/* Run a batch of statements, separated by ';', in one round trip and
+ * collect all of their results: a data frame for each SELECT-like
+ * statement, and the number of affected rows for the others. Unless the
+ * connection was opened with CLIENT_MULTI_STATEMENTS, that takes two more
+ * (short) round trips, to switch multiple statements on and back off.
+ * Like single statements, the batch can be interrupted all along.
+ */
+SEXP RS_MySQL_execMulti(SEXP conHandle, SEXP statements) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  RS_MySQL_conParams* conParams = con->conParams;
+
+  RS_MySQL_closePending(conHandle);
+  RS_MySQL_revive(con);
+  MYSQL* my_connection = con->drvConnection;
+
+  // Only switch multi statements on for this batch if the connection
+  // wasn't opened with CLIENT_MULTI_STATEMENTS
+  RMySQLBatch batch;
+  batch.con = con;
+  batch.sql = RS_MySQL_text(conParams, STRING_ELT(statements, 0));
+  batch.toggle = !(conParams->client_flag & CLIENT_MULTI_STATEMENTS);
+  batch.my_result = NULL;
+  if(batch.toggle && mysql_set_server_option(my_connection, MYSQL_OPTION_MULTI_STATEMENTS_ON))
+    error("could not enable multiple statements: %s", mysql_error(my_connection));
+
+  return R_ExecWithCleanup(rmysql_batch_run, &batch, rmysql_batch_cleanup, &batch);
+}
+
+
+// output is a named list
+SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
+  MySQLDriver   *mgr;
+  RS_DBI_resultSet *result;
+  RMySQLFields* flds;
+  MYSQL_RES *my_result;
+  SEXP output;
+
+  int    i, expand;
+  int   completed;
+  int   num_rec;
+  int    num_fields;
+
+  result = RS_DBI_getResultSet(rsHandle);
+  flds = result->fields;
+  if(!flds)
+    error("corrupt resultSet, missing fieldDescription");
+  num_rec = asInteger(max_rec);
+  expand = (num_rec < 0);   // dyn expand output to accommodate all rows
+  if(expand || num_rec == 0){
+    mgr = rmysql_driver();
+    num_rec = mgr->fetch_default_rec;
+  }
+  num_fields = flds->num_fields;
+  PROTECT(output = NEW_LIST((int) num_fields));
+  RS_DBI_allocOutput(output, flds, num_rec, 0);
+
+  // actual fetching....
+  RS_DBI_connection* con = RS_DBI_getConnection(rsHandle);
+  my_result = (MYSQL_RES *) result->drvResultSet;
+  completed = (int) 0;
+
+  if(result->drvStatement){
+    RS_DBI_resultSet* pending = RS_MySQL_pendingResult(con);
+    if(pending && pending->completed == 0)
+      error("connection with pending rows, close resultSet before continuing");
+    i = RS_MySQL_fetchCursor(result, output, &num_rec, expand, &completed);
+  } else {
+    i = RS_MySQL_fetchRows(con->drvConnection, my_result, flds, output,
+      &num_rec, expand, &completed);
+  }
+
+  if(completed == RMYSQL_INTERRUPTED){
+    // A cursor stays open on the server and can be fetched from again,
+    // a streamed result has to be stopped before the connection is usable
+    if(!result->drvStatement){
+      rmysql_abort_rows(con, my_result);
+      result->completed = -1;
+    }
+    error("fetch interrupted");
+  }
+
   // actual number of records fetched
   if(i < num_rec){
     num_rec = i;
-    // adjust the length of each of the members in the output_list
-    for(j = 0; j<num_fields; j++){
-      s_tmp = LST_EL(output,j);
-      PROTECT(SET_LENGTH(s_tmp, num_rec));
-      SET_ELEMENT(output, j, s_tmp);
-      UNPROTECT(1);
-    }
+    rmysql_truncate_output(output, num_fields, num_rec);
   }
-  if(completed < 0)
+  if(completed == -1){
+    // a statement stopped for running out of time is an error in its own right
+    unsigned int errnum = result->drvStatement ?
+      mysql_stmt_errno((MYSQL_STMT *) result->drvStatement) :
+      mysql_errno(con->drvConnection);
+    if(rmysql_is_timeout(errnum)){
+      result->completed = -1;
+      rmysql_error(errnum, "could not fetch rows", result->drvStatement ?
+        mysql_stmt_error((MYSQL_STMT *) result->drvStatement) :
+        mysql_error(con->drvConnection));
+    }
     warning("error while fetching rows");
+  }
 
   result->rowCount += num_rec;
   result->completed = (int) completed;
@@ -364,19 +646,64 @@ SEXP RS_MySQL_fetch(SEXP rsHandle, SEXP max_rec) {
   return output;
 }
 
+/* Read all rows of a stored result into a data frame. A stored result knows
+ * how many rows it has, so the output is allocated exactly once. With more
+ * than one thread, numbers are decoded in parallel (and can't be
+ * interrupted). On return *completed is 1, or RMYSQL_INTERRUPTED if the
+ * user interrupted.
+ */
+SEXP RS_MySQL_readDataFrame(MYSQL_RES* my_result, RS_MySQL_conParams* conParams,
+                            int* completed) {
+  int num_threads = conParams->threads;
+  int num_rec = (int) mysql_num_rows(my_result);
+
+  SEXP output = PROTECT(NEW_LIST(mysql_num_fields(my_result)));
+  RMySQLFields* flds = RS_MySQL_createDataMappings(my_result,
+    RS_MySQL_encoding(conParams));
+  RMySQLColumns* cols = rmysql_columns_alloc(output, flds, num_rec);
+
+  *completed = 1;
+  if(num_threads > 1)
+    rmysql_columns_decode_parallel(cols, my_result, num_threads);
+  while(rmysql_columns_decode(cols, my_result, RMYSQL_CHECK_ROWS) == RMYSQL_CHECK_ROWS){
+    if(RS_DBI_interrupted()){
+      *completed = RMYSQL_INTERRUPTED;
+      break;
+    }
+  }
+  rmysql_columns_finish(cols, output);
+
+  make_data_frame(output);
+  UNPROTECT(1);
+  return output;
+}
+
 
 SEXP RS_MySQL_closeResultSet(SEXP resHandle) {
   RS_DBI_resultSet *result;
   MYSQL_RES        *my_result;
 
   result = RS_DBI_getResultSet(resHandle);
+  if(result->drvStatement)
+    RS_MySQL_closeCursor(result);
 
   my_result = (MYSQL_RES *) result->drvResultSet;
-  if(my_result){
-    // we need to flush any possibly remaining rows (see Manual Ch 20 p358)
-    MYSQL_ROW row;
-    while((row = mysql_fetch_row(result->drvResultSet)))
-      ;
+  if(my_result && result->completed == 0){
+    // we need to flush any possibly remaining rows (see Manual Ch 20 p358).
+    // If there's more than a little of them, stop the query on the server
+    // rather than download the rest of it: then only the rows already in
+    // flight are left to read.
+    double bytes = 0;
+    while(mysql_fetch_row(my_result)){
+      unsigned long* lens = mysql_fetch_lengths(my_result);
+      unsigned int num_fields = mysql_num_fields(my_result);
+      for(unsigned int j = 0; j < num_fields; j++)
+        bytes += (double) lens[j] + 1;
+      if(bytes >= RMYSQL_ABORT_BYTES){
+        rmysql_abort_rows(RS_DBI_getConnection(resHandle), my_result);
+        break;
+      }
+    }
   }
   mysql_free_result(my_result);
 
@@ -0,0 +1,256 @@
+#include "RS-MySQL.h"
+#include <ctype.h>
+#include <strings.h>
+
+/* Prepared statements cached per connection.
+ *
+ * Preparing a statement costs a round trip and a parse on the server, and
+ * building its field mappings and result buffers on the client. Statements
+ * run repeatedly (e.g. by dbGetPreparedQuery in a loop) are kept prepared
+ * instead, keyed by their text with whitespace normalised, up to the
+ * connection's statement.cache entries; the least recently used one makes
+ * way for a new one. The statements belong to the connection's MYSQL handle,
+ * so reconnecting clears the cache, and so do USE and schema changes (see
+ * rmysql_stmt_cache_check).
+ */
+
+RMySQLStmtCache* rmysql_stmt_cache_alloc(int capacity) {
+  RMySQLStmtCache* cache = malloc(sizeof(RMySQLStmtCache));
+  if (!cache)
+    return NULL;
+
+  cache->capacity = capacity > 0 ? capacity : 0;
+  cache->size = 0;
+  cache->clock = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->stale = 0;
+  cache->entries = calloc(cache->capacity ? cache->capacity : 1,
+    sizeof(RMySQLStatement *));
+  if (!cache->entries) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/* Free statement. With close, the server is told to drop it; otherwise
+ * (in a forked child, whose socket isn't its own) the handle is abandoned.
+ */
+void rmysql_statement_free(RMySQLStatement* statement, int close) {
+  if (close && statement->stmt)
+    mysql_stmt_close(statement->stmt);
+  if (statement->fields)
+    rmysql_fields_free(statement->fields);
+  if (statement->binds)
+    rmysql_binds_free(statement->binds);
+  if (statement->sql)
+    free(statement->sql);
+  free(statement);
+}
+
+void rmysql_stmt_cache_clear(RMySQLStmtCache* cache, int close) {
+  for (int i = 0; i < cache->size; i++)
+    rmysql_statement_free(cache->entries[i], close);
+  cache->size = 0;
+}
+
+void rmysql_stmt_cache_free(RMySQLStmtCache* cache, int close) {
+  rmysql_stmt_cache_clear(cache, close);
+  free(cache->entries);
+  free(cache);
+}
+
+/* Copy of sql with runs of whitespace outside quotes collapsed to a single
+ * space, and none at either end, so that differently laid out copies of a
+ * statement share a cache entry. The newline ending a -- or # comment is
+ * kept, as it ends the comment.
+ */
+static char* rmysql_normalise_sql(const char* sql) {
+  char* out = malloc(strlen(sql) + 1);
+  if (!out)
+    return NULL;
+
+  char* p = out;
+  char quote = 0;
+  int space = 0;
+  for (; *sql; sql++) {
+    char c = *sql;
+    if (quote) {
+      *p++ = c;
+      if (c == '\\' && sql[1])
+        *p++ = *++sql;
+      else if (c == quote)
+        quote = 0;
+      continue;
+    }
+    if (isspace((unsigned char) c)) {
+      space = 1;
+      continue;
+    }
+    if (space && p > out && p[-1] != '\n')
+      *p++ = ' ';
+    space = 0;
+    if (c == '#' || (c == '-' && sql[1] == '-' && isspace((unsigned char) sql[2]))) {
+      while (*sql && *sql != '\n')
+        *p++ = *sql++;
+      if (!*sql)
+        break;
+      *p++ = '\n';
+      continue;
+    }
+    if (c == '\'' || c == '"' || c == '`')
+      quote = c;
+    *p++ = c;
+  }
+  *p = '\0';
+  return out;
+}
+
+/* Statements prepared before a USE would go on resolving unqualified
+ * tables in the old database, and ones prepared before a CREATE, DROP,
+ * ALTER or RENAME may no longer match the tables they read (the server
+ * then refuses to execute them, with CR_NEW_STMT_METADATA). So con's cache
+ * is cleared when statement (or one of a batch of them) starts with one of
+ * these. That's left to the next RS_MySQL_prepare, as statement's results
+ * may still be pending.
+ */
+static const char* rmysql_stmt_cache_stalers[] = {
+  "USE", "CREATE", "DROP", "ALTER", "RENAME", NULL
+};
+
+void rmysql_stmt_cache_check(RS_DBI_connection* con, const char* statement) {
+  if (!con->statements || con->statements->size == 0)
+    return;
+
+  for (const char* p = statement; p; p = strchr(p, ';')) {
+    if (*p == ';')
+      p++;
+    while (isspace((unsigned char) *p))
+      p++;
+    for (const char** word = rmysql_stmt_cache_stalers; *word; word++) {
+      size_t n = strlen(*word);
+      if (!strncasecmp(p, *word, n) && (isspace((unsigned char) p[n]) || p[n] == '`')) {
+        con->statements->stale = 1;
+        return;
+      }
+    }
+  }
+}
+
+static void rmysql_stmt_cache_remove(RMySQLStmtCache* cache, int i, int close) {
+  rmysql_statement_free(cache->entries[i], close);
+  cache->entries[i] = cache->entries[--cache->size];
+}
+
+static RMySQLStatement* rmysql_statement_prepare(RS_DBI_connection* con,
+                                                 const char* sql, char* key) {
+  MYSQL* my_connection = con->drvConnection;
+
+  RMySQLStatement* statement = calloc(1, sizeof(RMySQLStatement));
+  if (!statement) {
+    free(key);
+    error("Could not allocate memory for statement");
+  }
+  statement->sql = key;
+
+  statement->stmt = mysql_stmt_init(my_connection);
+  if (!statement->stmt) {
+    rmysql_statement_free(statement, 1);
+    error("could not allocate statement: %s", mysql_error(my_connection));
+  }
+
+  if (mysql_stmt_prepare(statement->stmt, sql, strlen(sql))) {
+    char msg[MYSQL_ERRMSG_SIZE];
+    strncpy(msg, mysql_stmt_error(statement->stmt), MYSQL_ERRMSG_SIZE - 1);
+    msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+    unsigned int errnum = mysql_stmt_errno(statement->stmt);
+    rmysql_statement_free(statement, 1);
+    rmysql_error(errnum, "could not prepare statement", msg);
+  }
+
+  MYSQL_RES* metadata = mysql_stmt_result_metadata(statement->stmt);
+  if (metadata) {
+    statement->fields = RS_MySQL_createDataMappings(metadata,
+      RS_MySQL_encoding(con->conParams));
+    mysql_free_result(metadata);
+    statement->binds = rmysql_binds_alloc(statement->fields);
+    if (mysql_stmt_bind_result(statement->stmt, statement->binds->bind)) {
+      char msg[MYSQL_ERRMSG_SIZE];
+      strncpy(msg, mysql_stmt_error(statement->stmt), MYSQL_ERRMSG_SIZE - 1);
+      msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+      rmysql_statement_free(statement, 1);
+      error("could not bind result: %s", msg);
+    }
+  }
+
+  return statement;
+}
+
+/* A prepared statement for sql on con, with its field mappings and result
+ * buffers bound, from the cache if it's there. Hand it back with
+ * RS_MySQL_releaseStatement.
+ */
+RMySQLStatement* RS_MySQL_prepare(RS_DBI_connection* con, const char* sql) {
+  RMySQLStmtCache* cache = con->statements;
+
+  if (cache && cache->stale) {
+    rmysql_stmt_cache_clear(cache, 1);
+    cache->stale = 0;
+  }
+
+  char* key = rmysql_normalise_sql(sql);
+  if (!key)
+    error("Could not allocate memory for statement");
+
+  for (int i = 0; cache && i < cache->size; i++) {
+    RMySQLStatement* statement = cache->entries[i];
+    if (strcmp(statement->sql, key))
+      continue;
+    free(key);
+    cache->hits++;
+    statement->last_used = ++cache->clock;
+    return statement;
+  }
+
+  RMySQLStatement* statement = rmysql_statement_prepare(con, sql, key);
+  if (!cache || cache->capacity == 0)
+    return statement;
+
+  cache->misses++;
+  if (cache->size == cache->capacity) {
+    int lru = 0;
+    for (int i = 1; i < cache->size; i++) {
+      if (cache->entries[i]->last_used < cache->entries[lru]->last_used)
+        lru = i;
+    }
+    rmysql_stmt_cache_remove(cache, lru, 1);
+  }
+  statement->last_used = ++cache->clock;
+  statement->cached = 1;
+  cache->entries[cache->size++] = statement;
+  return statement;
+}
+
+/* Done with statement. A statement that isn't cached is closed, and so is
+ * one that failed, in case it's no longer usable.
+ */
+void RS_MySQL_releaseStatement(RS_DBI_connection* con, RMySQLStatement* statement,
+                               int failed) {
+  RMySQLStmtCache* cache = con->statements;
+
+  if (!statement->cached) {
+    rmysql_statement_free(statement, 1);
+    return;
+  }
+
+  mysql_stmt_free_result(statement->stmt);
+  if (!failed)
+    return;
+  for (int i = 0; i < cache->size; i++) {
+    if (cache->entries[i] == statement) {
+      rmysql_stmt_cache_remove(cache, i, 1);
+      return;
+    }
+  }
+}
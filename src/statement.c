@@ -0,0 +1,527 @@
+#include "RS-MySQL.h"
+
+// Strings start out with a small buffer, which is grown (and re-bound) the
+// first time a longer value comes along.
+#define RMYSQL_STRING_BUFFER 256
+
+RMySQLBinds* rmysql_binds_alloc(RMySQLFields* flds) {
+  int n = flds->num_fields;
+
+  RMySQLBinds* binds = malloc(sizeof(RMySQLBinds));
+  if (!binds) {
+    error("Could not allocate memory for statement buffers");
+  }
+
+  binds->num_fields = n;
+  binds->bind =     calloc(n, sizeof(MYSQL_BIND));
+  binds->length =   calloc(n, sizeof(unsigned long));
+  binds->is_null =  calloc(n, sizeof(my_bool));
+  binds->error =    calloc(n, sizeof(my_bool));
+  binds->buffer =   calloc(n, sizeof(void *));
+  binds->capacity = calloc(n, sizeof(unsigned long));
+
+  for (int j = 0; j < n; j++) {
+    MYSQL_BIND* bind = &binds->bind[j];
+
+    switch(flds->Sclass[j]) {
+    case INTSXP:
+      bind->buffer_type = MYSQL_TYPE_LONG;
+      binds->capacity[j] = sizeof(int);
+      break;
+    case REALSXP:
+      bind->buffer_type = MYSQL_TYPE_DOUBLE;
+      binds->capacity[j] = sizeof(double);
+      break;
+    default:
+      bind->buffer_type = MYSQL_TYPE_STRING;
+      binds->capacity[j] = RMYSQL_STRING_BUFFER;
+      if (flds->length[j] >= 0 && flds->length[j] < RMYSQL_STRING_BUFFER)
+        binds->capacity[j] = flds->length[j] + 1;
+      break;
+    }
+
+    binds->buffer[j] = malloc(binds->capacity[j]);
+    if (!binds->buffer[j]) {
+      rmysql_binds_free(binds);
+      error("Could not allocate memory for statement buffers");
+    }
+    bind->buffer = binds->buffer[j];
+    bind->buffer_length = binds->capacity[j];
+    bind->length = &binds->length[j];
+    bind->is_null = &binds->is_null[j];
+    bind->error = &binds->error[j];
+  }
+
+  return binds;
+}
+
+void rmysql_binds_free(RMySQLBinds* binds) {
+  if (binds->buffer) {
+    for (int j = 0; j < binds->num_fields; j++) {
+      if (binds->buffer[j])
+        free(binds->buffer[j]);
+    }
+    free(binds->buffer);
+  }
+  if (binds->bind) free(binds->bind);
+  if (binds->length) free(binds->length);
+  if (binds->is_null) free(binds->is_null);
+  if (binds->error) free(binds->error);
+  if (binds->capacity) free(binds->capacity);
+  free(binds);
+}
+
+/* Re-read the string columns that didn't fit in their buffers, growing the
+ * buffers so the following rows fit straight away. Returns non-zero on
+ * failure.
+ */
+static int rmysql_binds_refetch(MYSQL_STMT* stmt, RMySQLBinds* binds) {
+  int rebind = 0;
+
+  for (int j = 0; j < binds->num_fields; j++) {
+    MYSQL_BIND* bind = &binds->bind[j];
+    if (!binds->error[j] || bind->buffer_type != MYSQL_TYPE_STRING)
+      continue;
+    if (binds->length[j] < binds->capacity[j])
+      continue;
+
+    unsigned long capacity = binds->length[j] + 1;
+    void* buffer = realloc(binds->buffer[j], capacity);
+    if (!buffer)
+      return 1;
+
+    binds->buffer[j] = buffer;
+    binds->capacity[j] = capacity;
+    bind->buffer = buffer;
+    bind->buffer_length = capacity;
+    if (mysql_stmt_fetch_column(stmt, bind, j, 0))
+      return 1;
+    rebind = 1;
+  }
+
+  if (rebind && mysql_stmt_bind_result(stmt, binds->bind))
+    return 1;
+  return 0;
+}
+
+static void rmysql_binds_store(SEXP output, RMySQLBinds* binds,
+                               RMySQLFields* flds, int i) {
+  for (int j = 0; j < binds->num_fields; j++) {
+    int null_item = binds->is_null[j];
+    int truncated = 0;
+
+    switch(flds->Sclass[j]) {
+    case INTSXP:
+      if (null_item)
+        NA_SET(&(LST_INT_EL(output,j,i)), INTSXP);
+      else
+        LST_INT_EL(output,j,i) = *((int *) binds->buffer[j]);
+      break;
+    case REALSXP:
+      if (null_item)
+        NA_SET(&(LST_NUM_EL(output,j,i)), REALSXP);
+      else
+        LST_NUM_EL(output,j,i) = *((double *) binds->buffer[j]);
+      break;
+    default:
+      if (null_item) {
+        SET_LST_CHR_EL(output,j,i,NA_STRING);
+        break;
+      }
+      SET_LST_CHR_EL(output,j,i,
+        rmysql_mkchar((char *) binds->buffer[j], binds->length[j],
+          flds->encoding[j], &truncated));
+      if (truncated)
+        warning("row %d field %d truncated at embedded nul", i, j);
+      break;
+    }
+  }
+}
+
+/* Open a read-only server-side cursor for statement. The rows stay on the
+ * server and are sent s_prefetch at a time as RS_MySQL_fetch asks for them,
+ * so the client only ever buffers one chunk and the connection is free to
+ * run other statements in the meantime.
+ */
+SEXP RS_MySQL_execCursor(SEXP conHandle, SEXP statement, SEXP s_prefetch) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  const char* dyn_statement = RS_MySQL_text(con->conParams, STRING_ELT(statement, 0));
+
+  int prefetch_rows = (s_prefetch == R_NilValue) ?
+    rmysql_driver()->fetch_default_rec : asInteger(s_prefetch);
+  if (prefetch_rows == NA_INTEGER || prefetch_rows < 1)
+    error("prefetch must be a positive number of rows");
+  unsigned long prefetch = (unsigned long) prefetch_rows;
+
+  RS_MySQL_closePending(conHandle);
+  RS_MySQL_revive(con);
+  MYSQL* my_connection = con->drvConnection;
+
+  MYSQL_STMT* stmt = mysql_stmt_init(my_connection);
+  if (!stmt)
+    error("could not allocate statement: %s", mysql_error(my_connection));
+
+  unsigned long cursor_type = (unsigned long) CURSOR_TYPE_READ_ONLY;
+  if (mysql_stmt_prepare(stmt, dyn_statement, strlen(dyn_statement)) ||
+      mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &cursor_type) ||
+      mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch) ||
+      mysql_stmt_execute(stmt)) {
+    char msg[MYSQL_ERRMSG_SIZE];
+    strncpy(msg, mysql_stmt_error(stmt), MYSQL_ERRMSG_SIZE - 1);
+    msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+    unsigned int errnum = mysql_stmt_errno(stmt);
+    mysql_stmt_close(stmt);
+    rmysql_error(errnum, "could not run statement", msg);
+  }
+
+  SEXP rsHandle = PROTECT(RS_DBI_allocResultSet(conHandle));
+  RS_DBI_resultSet* result = RS_DBI_getResultSet(rsHandle);
+  result->statement = RS_DBI_copyString(dyn_statement);
+  result->rowCount = (int) 0;
+
+  MYSQL_RES* metadata = mysql_stmt_result_metadata(stmt);
+  if (!metadata) {
+    // Not a SELECT-like statement: nothing to keep open
+    result->isSelect = FALSE;
+    result->rowsAffected = (int) mysql_stmt_affected_rows(stmt);
+    result->completed = 1;
+    mysql_stmt_close(stmt);
+    UNPROTECT(1);
+    return rsHandle;
+  }
+
+  result->isSelect = TRUE;
+  result->rowsAffected = (int) -1;
+  result->completed = 0;
+  result->drvStatement = (void *) stmt;
+  result->drvResultSet = (void *) metadata;
+  result->fields = RS_MySQL_createDataMappings(result->drvResultSet,
+    RS_MySQL_encoding(con->conParams));
+
+  RMySQLBinds* binds = rmysql_binds_alloc(result->fields);
+  result->drvBinds = (void *) binds;
+  if (mysql_stmt_bind_result(stmt, binds->bind))
+    error("could not bind result: %s", mysql_stmt_error(stmt));
+
+  UNPROTECT(1);
+  return rsHandle;
+}
+
+/* Fetch up to *num_rec rows (or all of them if expand) from a server-side
+ * cursor into output. Returns the number of rows read.
+ */
+int RS_MySQL_fetchCursor(RS_DBI_resultSet* result, SEXP output, int* num_rec,
+                         int expand, int* completed) {
+  MYSQL_STMT* stmt = (MYSQL_STMT *) result->drvStatement;
+  RMySQLBinds* binds = (RMySQLBinds *) result->drvBinds;
+
+  // Each chunk asked for is a single round trip to the server
+  if (!expand) {
+    unsigned long prefetch = (unsigned long) *num_rec;
+    mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch);
+  }
+
+  int i;
+  for (i = 0; ; i++) {
+    if (i == *num_rec) {
+      if (expand) {
+        *num_rec = 2 * (*num_rec);
+        RS_DBI_allocOutput(output, result->fields, *num_rec, expand);
+      } else {
+        break;
+      }
+    }
+    if (i > 0 && i % RMYSQL_CHECK_ROWS == 0 && RS_DBI_interrupted()) {
+      *completed = RMYSQL_INTERRUPTED;
+      break;
+    }
+
+    int rc = mysql_stmt_fetch(stmt);
+    if (rc == MYSQL_NO_DATA) {
+      *completed = 1;
+      break;
+    }
+    if (rc == MYSQL_DATA_TRUNCATED)
+      rc = rmysql_binds_refetch(stmt, binds);
+    if (rc) {
+      *completed = -1;
+      break;
+    }
+
+    rmysql_binds_store(output, binds, result->fields, i);
+  }
+
+  return i;
+}
+
+void RS_MySQL_closeCursor(RS_DBI_resultSet* result) {
+  if (result->drvResultSet) {
+    mysql_free_result((MYSQL_RES *) result->drvResultSet);
+    result->drvResultSet = NULL;
+  }
+  if (result->drvBinds) {
+    rmysql_binds_free((RMySQLBinds *) result->drvBinds);
+    result->drvBinds = NULL;
+  }
+  mysql_stmt_close((MYSQL_STMT *) result->drvStatement);
+  result->drvStatement = NULL;
+}
+
+// Parameters of a prepared statement, bound to the columns of a data frame
+typedef struct RMySQLParams {
+  int num_params;
+  MYSQL_BIND *bind;
+  unsigned long *length;
+  my_bool *is_null;
+  int *ints;
+  double *reals;
+  int utf8;              // send strings in UTF-8
+} RMySQLParams;
+
+static void rmysql_params_free(RMySQLParams* params) {
+  if (params->bind) free(params->bind);
+  if (params->length) free(params->length);
+  if (params->is_null) free(params->is_null);
+  if (params->ints) free(params->ints);
+  if (params->reals) free(params->reals);
+  free(params);
+}
+
+static RMySQLParams* rmysql_params_alloc(SEXP bind_data) {
+  int n = length(bind_data);
+
+  RMySQLParams* params = malloc(sizeof(RMySQLParams));
+  if (!params)
+    return NULL;
+
+  params->num_params = n;
+  params->utf8 = 0;
+  params->bind =    calloc(n ? n : 1, sizeof(MYSQL_BIND));
+  params->length =  calloc(n ? n : 1, sizeof(unsigned long));
+  params->is_null = calloc(n ? n : 1, sizeof(my_bool));
+  params->ints =    calloc(n ? n : 1, sizeof(int));
+  params->reals =   calloc(n ? n : 1, sizeof(double));
+  if (!params->bind || !params->length || !params->is_null || !params->ints ||
+      !params->reals) {
+    rmysql_params_free(params);
+    return NULL;
+  }
+
+  for (int j = 0; j < n; j++) {
+    MYSQL_BIND* bind = &params->bind[j];
+    bind->is_null = &params->is_null[j];
+    bind->length = &params->length[j];
+
+    switch(TYPEOF(VECTOR_ELT(bind_data, j))) {
+    case INTSXP:
+    case LGLSXP:
+      bind->buffer_type = MYSQL_TYPE_LONG;
+      bind->buffer = &params->ints[j];
+      break;
+    case REALSXP:
+      bind->buffer_type = MYSQL_TYPE_DOUBLE;
+      bind->buffer = &params->reals[j];
+      break;
+    default:
+      bind->buffer_type = MYSQL_TYPE_STRING;
+      break;
+    }
+  }
+
+  return params;
+}
+
+/* Point the parameters at row i of bind_data. Strings aren't copied: the
+ * binds point into their CHARSXPs (or their translation to UTF-8, which
+ * lasts until the next row), which is why they're re-bound each row.
+ */
+static void rmysql_params_set(RMySQLParams* params, SEXP bind_data, int i) {
+  for (int j = 0; j < params->num_params; j++) {
+    SEXP col = VECTOR_ELT(bind_data, j);
+    MYSQL_BIND* bind = &params->bind[j];
+
+    switch(TYPEOF(col)) {
+    case INTSXP:
+    case LGLSXP:
+      params->ints[j] = INTEGER(col)[i];
+      params->is_null[j] = params->ints[j] == NA_INTEGER;
+      break;
+    case REALSXP:
+      params->reals[j] = REAL(col)[i];
+      params->is_null[j] = ISNAN(params->reals[j]);
+      break;
+    default: {
+      SEXP value = STRING_ELT(col, i);
+      params->is_null[j] = value == NA_STRING;
+      const char* text = params->utf8 && !params->is_null[j] ?
+        translateCharUTF8(value) : CHAR(value);
+      bind->buffer = (void *) text;
+      params->length[j] = text == CHAR(value) ? (unsigned long) LENGTH(value) :
+        (unsigned long) strlen(text);
+      bind->buffer_length = params->length[j];
+      break;
+    }
+    }
+  }
+}
+
+// Running a prepared statement over bind_data, with R_ExecWithCleanup so
+// that the parameters and the statement are let go of on any error
+typedef struct RMySQLExecPrepared {
+  RS_DBI_connection *con;
+  RMySQLStatement *prepared;
+  RMySQLParams *params;
+  SEXP bind_data;
+  int failed;                // the statement is in an unknown state
+} RMySQLExecPrepared;
+
+static void rmysql_exec_prepared_cleanup(void* data) {
+  RMySQLExecPrepared* exec = (RMySQLExecPrepared *) data;
+  rmysql_params_free(exec->params);
+  RS_MySQL_releaseStatement(exec->con, exec->prepared, exec->failed);
+}
+
+// "row", unless the result has a column of that name: then ".row", "..row"...
+static SEXP rmysql_row_name(SEXP output_names) {
+  char name[32] = "row";
+  for (;;) {
+    int taken = 0;
+    for (int j = 0; j < length(output_names) && !taken; j++)
+      taken = !strcmp(CHAR(STRING_ELT(output_names, j)), name);
+    if (!taken || strlen(name) == sizeof(name) - 1)
+      break;
+    memmove(name + 1, name, strlen(name) + 1);
+    name[0] = '.';
+  }
+  return mkChar(name);
+}
+
+static SEXP rmysql_exec_prepared(void* data) {
+  RMySQLExecPrepared* exec = (RMySQLExecPrepared *) data;
+  SEXP bind_data = exec->bind_data;
+  RMySQLParams* params = exec->params;
+  MYSQL_STMT* stmt = exec->prepared->stmt;
+  int num_rows = length(bind_data) ? length(VECTOR_ELT(bind_data, 0)) : 0;
+
+  RMySQLFields* flds = exec->prepared->fields;
+  RMySQLBinds* binds = exec->prepared->binds;
+  SEXP output, index;
+  PROTECT_INDEX ipx;
+  int num_rec = num_rows > 0 ? num_rows : 1, n = 0;
+
+  if (flds) {
+    output = PROTECT(NEW_LIST(flds->num_fields));
+    RS_DBI_allocOutput(output, flds, num_rec, 0);
+    PROTECT_WITH_INDEX(index = NEW_INTEGER(num_rec), &ipx);
+  } else {
+    output = PROTECT(R_NilValue);
+    PROTECT_WITH_INDEX(index = NEW_NUMERIC(num_rows), &ipx);
+  }
+
+  const void* vmax = vmaxget();
+  for (int i = 0; i < num_rows; i++) {
+    if (i > 0 && i % RMYSQL_CHECK_ROWS == 0 && RS_DBI_interrupted())
+      error("query interrupted");
+
+    // Let go of the last row's translated strings
+    vmaxset(vmax);
+    rmysql_params_set(params, bind_data, i);
+    if (mysql_stmt_bind_param(stmt, params->bind) || mysql_stmt_execute(stmt)) {
+      exec->failed = 1;
+      rmysql_error(mysql_stmt_errno(stmt), "could not run statement",
+        mysql_stmt_error(stmt));
+    }
+    if (!binds) {
+      REAL(index)[i] = (double) mysql_stmt_affected_rows(stmt);
+      continue;
+    }
+    for (;;) {
+      int rc = mysql_stmt_fetch(stmt);
+      if (rc == MYSQL_NO_DATA)
+        break;
+      if (rc == MYSQL_DATA_TRUNCATED)
+        rc = rmysql_binds_refetch(stmt, binds);
+      if (rc) {
+        exec->failed = 1;
+        rmysql_error(mysql_stmt_errno(stmt), "could not fetch rows",
+          mysql_stmt_error(stmt));
+      }
+
+      if (n == num_rec) {
+        num_rec *= 2;
+        RS_DBI_allocOutput(output, flds, num_rec, 1);
+        REPROTECT(index = lengthgets(index, num_rec), ipx);
+      }
+      rmysql_binds_store(output, binds, flds, n);
+      INTEGER(index)[n] = i + 1;
+      n++;
+    }
+    mysql_stmt_free_result(stmt);
+  }
+
+  if (!flds) {
+    UNPROTECT(2);
+    return index;
+  }
+
+  RS_DBI_allocOutput(output, flds, n, 1);
+  REPROTECT(index = lengthgets(index, n), ipx);
+
+  int num_fields = flds->num_fields;
+  SEXP out = PROTECT(NEW_LIST(num_fields + 1));
+  SEXP names = PROTECT(NEW_CHARACTER(num_fields + 1));
+  SEXP output_names = getAttrib(output, R_NamesSymbol);
+  SET_VECTOR_ELT(out, 0, index);
+  SET_STRING_ELT(names, 0, rmysql_row_name(output_names));
+  for (int j = 0; j < num_fields; j++) {
+    SET_VECTOR_ELT(out, j + 1, VECTOR_ELT(output, j));
+    SET_STRING_ELT(names, j + 1, STRING_ELT(output_names, j));
+  }
+  SET_NAMES(out, names);
+
+  make_data_frame(out);
+  UNPROTECT(4);
+  return out;
+}
+
+/* Prepare statement once, then execute it for each row of bind_data (a list
+ * of equally long integer, logical, double or character vectors), binding
+ * the row's values to the statement's parameters. Rows of the results are
+ * stacked into one data frame, with an integer first column "row" (or
+ * ".row", and so on, if a column of the result already has that name)
+ * giving the row of bind_data each one came from. Statements that don't
+ * return rows give the number of rows affected by each execution instead.
+ */
+SEXP RS_MySQL_execPrepared(SEXP conHandle, SEXP statement, SEXP bind_data) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  const char* dyn_statement = RS_MySQL_text(con->conParams, STRING_ELT(statement, 0));
+
+  RS_MySQL_closePending(conHandle);
+  RS_MySQL_revive(con);
+
+  RMySQLStatement* prepared = RS_MySQL_prepare(con, dyn_statement);
+  MYSQL_STMT* stmt = prepared->stmt;
+  if (mysql_stmt_param_count(stmt) != (unsigned long) length(bind_data)) {
+    int expected = (int) mysql_stmt_param_count(stmt);
+    RS_MySQL_releaseStatement(con, prepared, 0);
+    error("statement has %d parameters, but bind.data has %d columns",
+      expected, length(bind_data));
+  }
+
+  RMySQLParams* params = rmysql_params_alloc(bind_data);
+  if (!params) {
+    RS_MySQL_releaseStatement(con, prepared, 0);
+    error("Could not allocate memory for statement parameters");
+  }
+
+  params->utf8 = RS_MySQL_encoding(con->conParams) == CE_UTF8;
+
+  RMySQLExecPrepared exec;
+  exec.con = con;
+  exec.prepared = prepared;
+  exec.params = params;
+  exec.bind_data = bind_data;
+  exec.failed = 0;
+  return R_ExecWithCleanup(rmysql_exec_prepared, &exec,
+    rmysql_exec_prepared_cleanup, &exec);
+}
@@ -0,0 +1,95 @@
+#include "RS-MySQL.h"
+
+/* Transactions are driven straight through the client library: no result
+ * set is allocated and nothing needs to be fetched or cleared afterwards.
+ */
+
+static RS_DBI_connection* rmysql_idle_connection(SEXP conHandle) {
+  RS_DBI_connection* con = RS_DBI_getConnection(conHandle);
+  RS_MySQL_closePending(conHandle);
+  return con;
+}
+
+// Returns the number of affected rows, -1 on error or RMYSQL_INTERRUPTED
+static int rmysql_run(RS_DBI_connection* con, const char* statement) {
+  // Discard any rows (e.g. SELECT ... FOR UPDATE) so the connection is free
+  MYSQL_RES* my_result;
+  int state = RS_MySQL_query(con, statement, 1, &my_result);
+  MYSQL* my_connection = (MYSQL *) con->drvConnection;
+  if (state == RMYSQL_INTERRUPTED)
+    return RMYSQL_INTERRUPTED;
+  if (state)
+    return -1;
+
+  if (my_result) {
+    mysql_free_result(my_result);
+    return 0;
+  }
+  if (mysql_field_count(my_connection) > 0)
+    return -1;
+
+  return (int) mysql_affected_rows(my_connection);
+}
+
+SEXP RS_MySQL_begin(SEXP conHandle) {
+  RS_DBI_connection* con = rmysql_idle_connection(conHandle);
+
+  if (rmysql_run(con, "START TRANSACTION") < 0)
+    error("could not start transaction: %s", mysql_error(con->drvConnection));
+
+  return ScalarLogical(TRUE);
+}
+
+SEXP RS_MySQL_commit(SEXP conHandle) {
+  MYSQL* my_connection = rmysql_idle_connection(conHandle)->drvConnection;
+
+  if (mysql_commit(my_connection))
+    error("could not commit transaction: %s", mysql_error(my_connection));
+
+  return ScalarLogical(TRUE);
+}
+
+SEXP RS_MySQL_rollback(SEXP conHandle) {
+  MYSQL* my_connection = rmysql_idle_connection(conHandle)->drvConnection;
+
+  if (mysql_rollback(my_connection))
+    error("could not roll back transaction: %s", mysql_error(my_connection));
+
+  return ScalarLogical(TRUE);
+}
+
+/* Run all statements in a single transaction. If any of them fails the
+ * transaction is rolled back and none of the changes are kept. Returns the
+ * number of rows affected by each statement.
+ */
+SEXP RS_MySQL_execTransaction(SEXP conHandle, SEXP statements) {
+  RS_DBI_connection* con = rmysql_idle_connection(conHandle);
+  int n = length(statements);
+
+  if (rmysql_run(con, "START TRANSACTION") < 0)
+    error("could not start transaction: %s", mysql_error(con->drvConnection));
+  MYSQL* my_connection = (MYSQL *) con->drvConnection;
+
+  SEXP output = PROTECT(allocVector(INTSXP, n));
+  for (int i = 0; i < n; i++) {
+    int rows = rmysql_run(con, RS_MySQL_text(con->conParams, STRING_ELT(statements, i)));
+    if (rows == RMYSQL_INTERRUPTED) {
+      mysql_rollback(my_connection);
+      error("statement %d interrupted, transaction rolled back", i + 1);
+    }
+    if (rows < 0) {
+      char msg[MYSQL_ERRMSG_SIZE];
+      strncpy(msg, mysql_error(my_connection), MYSQL_ERRMSG_SIZE - 1);
+      msg[MYSQL_ERRMSG_SIZE - 1] = '\0';
+      mysql_rollback(my_connection);
+      error("could not run statement %d, transaction rolled back: %s", i + 1, msg);
+    }
+    INTEGER(output)[i] = rows;
+  }
+
+  if (mysql_commit(my_connection))
+    error("could not commit transaction: %s", mysql_error(my_connection));
+
+  UNPROTECT(1);
+  return output;
+}
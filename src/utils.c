@@ -1,4 +1,5 @@
 #include "RS-MySQL.h"
+#include <stdint.h>
 
 // Turn a list in to a data frame, in place
 void make_data_frame(SEXP data) {
@@ -217,46 +218,142 @@ int
     return out;
   }
 
+static void rmysql_check_interrupt(void* dummy) {
+  R_CheckUserInterrupt();
+}
 
-/* The single string version of this function was kindly provided by
-* J. T. Lindgren (any bugs are probably dj's)
-*
-* NOTE/BUG?: This function could potentially grab a huge amount of memory
-*   if given (not inappropriately) very large binary objects. How should
-*   we protect against potentially deadly requests?
-*/
+/* Has the user asked to interrupt? Unlike R_CheckUserInterrupt this returns
+ * instead of jumping out, so the caller gets to clean up the connection
+ * before raising the error itself.
+ */
+int RS_DBI_interrupted(void) {
+  return R_ToplevelExec(rmysql_check_interrupt, NULL) == FALSE;
+}
 
-SEXP rmysql_escape_strings(SEXP conHandle, SEXP strings) {
-  MYSQL* con = RS_DBI_getConnection(conHandle)->drvConnection;
+/* CHARSXP for the len bytes at value. R strings can't hold NUL bytes, so a
+ * value with one in it is cut short there and *truncated is incremented.
+ */
+SEXP rmysql_mkchar(const char* value, unsigned long len, cetype_t encoding,
+                   int* truncated) {
+  const char* nul = memchr(value, '\0', len);
+  if (nul) {
+    len = (unsigned long) (nul - value);
+    (*truncated)++;
+  }
+  return mkCharLenCE(value, (int) len, encoding);
+}
+
+// Bytes mysql_real_escape_string() may change: NUL, \n, \r, \, ', " and ^Z
+static const unsigned char rmysql_escaped[256] = {
+  [0] = 1, ['\n'] = 1, ['\r'] = 1, ['\\'] = 1, ['\''] = 1, ['"'] = 1,
+  [26] = 1
+};
+
+#define RMYSQL_ONES 0x0101010101010101ULL
+#define RMYSQL_HIGHS 0x8080808080808080ULL
+
+// Non-zero if some byte of word is c
+static inline uint64_t rmysql_has_byte(uint64_t word, unsigned char c) {
+  uint64_t x = word ^ (RMYSQL_ONES * c);
+  return (x - RMYSQL_ONES) & ~x & RMYSQL_HIGHS;
+}
+
+/* Does the string need escaping at all? Most don't, so this is checked
+ * eight bytes at a time before involving the client library.
+ */
+static int rmysql_needs_escape(const char* string, size_t len) {
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, string + i, 8);
+    if (rmysql_has_byte(word, 0) | rmysql_has_byte(word, '\n') |
+        rmysql_has_byte(word, '\r') | rmysql_has_byte(word, '\\') |
+        rmysql_has_byte(word, '\'') | rmysql_has_byte(word, '"') |
+        rmysql_has_byte(word, 26))
+      return 1;
+  }
+  for (; i < len; i++) {
+    if (rmysql_escaped[(unsigned char) string[i]])
+      return 1;
+  }
+  return 0;
+}
+
+// Length of value, the text of string, translated or not
+static size_t rmysql_text_length(SEXP string, const char* value) {
+  return value == CHAR(string) ? (size_t) LENGTH(string) : strlen(value);
+}
+
+/* Escape (and, if quote, single quote) each of strings for con. Strings
+ * without special characters skip mysql_real_escape_string(), and when not
+ * quoting keep their CHARSXP. NA stays NA, or becomes NULL when quoting.
+ * On UTF-8 connections strings are escaped (and returned) in UTF-8.
+ */
+static SEXP rmysql_escape(SEXP conHandle, SEXP strings, int quote) {
+  RS_DBI_connection* connection = RS_DBI_getConnection(conHandle);
+  RS_MySQL_conParams* conParams = connection->conParams;
+  MYSQL* con = connection->drvConnection;
 
   int n = length(strings);
   SEXP output = PROTECT(allocVector(STRSXP, n));
 
-  long size = 100;
-  char* escaped = S_alloc(size, sizeof(escaped));
+  // Room for the longest string escaped, plus quotes and terminator
+  size_t max_len = 0;
+  for (int i = 0; i < n; i++) {
+    SEXP string = STRING_ELT(strings, i);
+    size_t len = string == NA_STRING ? 0 :
+      rmysql_text_length(string, RS_MySQL_text(conParams, string));
+    if (len > max_len)
+      max_len = len;
+  }
+  char* escaped = R_alloc(2 * max_len + 3, 1);
 
-  for(int i = 0; i < n; i++){
-    const char* string = CHAR(STRING_ELT(strings, i));
+  for (int i = 0; i < n; i++) {
+    SEXP string = STRING_ELT(strings, i);
 
-    size_t len = strlen(string);
-    if (size <= 2 * len + 1) {
-      escaped = S_realloc(escaped, (2 * len + 1), size, sizeof(escaped));
-      size = 2 * len + 1;
+    if (string == NA_STRING) {
+      SET_STRING_ELT(output, i, quote ? mkChar("NULL") : NA_STRING);
+      continue;
     }
 
-    if (escaped == NULL) {
-      UNPROTECT(1);
-      error("Could not allocate memory to escape string");
+    const char* value = RS_MySQL_text(conParams, string);
+    size_t len = rmysql_text_length(string, value);
+    int needs_escape = rmysql_needs_escape(value, len);
+    if (!needs_escape && !quote) {
+      SET_STRING_ELT(output, i, string);
+      continue;
     }
 
-    mysql_real_escape_string(con, escaped, string, len);
-    SET_STRING_ELT(output, i, mkChar(escaped));
+    char* out = escaped;
+    if (quote)
+      *out++ = '\'';
+    if (needs_escape) {
+      out += mysql_real_escape_string(con, out, value, len);
+    } else {
+      memcpy(out, value, len);
+      out += len;
+    }
+    if (quote)
+      *out++ = '\'';
+
+    SET_STRING_ELT(output, i,
+      mkCharLenCE(escaped, (int) (out - escaped),
+        conParams->utf8 ? CE_UTF8 : getCharCE(string)));
   }
 
   UNPROTECT(1);
   return output;
 }
 
+SEXP rmysql_escape_strings(SEXP conHandle, SEXP strings) {
+  return rmysql_escape(conHandle, strings, 0);
+}
+
+SEXP rmysql_quote_strings(SEXP conHandle, SEXP strings) {
+  return rmysql_escape(conHandle, strings, 1);
+}
+
 SEXP rmysql_version() {
   SEXP output = PROTECT(allocVector(INTSXP, 2));
   SEXP output_nms = PROTECT(allocVector(STRSXP, 2));
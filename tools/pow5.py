@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+# Generates src/pow5.c, the table of 128-bit powers of five used by the
+# double parser in src/parse.c:
+#
+#   python3 tools/pow5.py > src/pow5.c
+#
+# Entry q (from -342 to 308) holds 5^q normalised so that its top bit is set,
+# high 64 bits first. Positive powers are truncated, negative powers are
+# rounded up (see Lemire, "Number Parsing at a Gigabyte per Second").
+
+SMALLEST, LARGEST = -342, 308
+
+def entry(q):
+    if q >= 0:
+        power5 = 5 ** q
+        while power5 < (1 << 127):
+            power5 *= 2
+        while power5 >= (1 << 128):
+            power5 //= 2
+        return power5
+    power5 = 5 ** -q
+    z = power5.bit_length()
+    if q >= -27:
+        return 2 ** (z + 127) // power5 + 1
+    c = 2 ** (2 * z + 2 * 64) // power5 + 1
+    while c >= (1 << 128):
+        c //= 2
+    return c
+
+print("/* Generated by tools/pow5.py, do not edit */")
+print()
+print('#include "parse.h"')
+print()
+print("const int rmysql_pow5_smallest = %d;" % SMALLEST)
+print("const int rmysql_pow5_largest = %d;" % LARGEST)
+print()
+print("const uint64_t rmysql_pow5_128[] = {")
+for q in range(SMALLEST, LARGEST + 1):
+    c = entry(q)
+    print("  0x%016xULL, 0x%016xULL, // 5^%d" % (c >> 64, c & ((1 << 64) - 1), q))
+print("};")